@@ -0,0 +1,171 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "node.h"
+
+/* Software event sampling.
+ *
+ * With SCG_FAULTS=N or SCG_SWITCHES=N in the environment, each thread opens a
+ * perf event counting its page faults or context switches, which signals the
+ * thread itself every N events.  The signal handler adds N to the
+ * SCG_PAGE_FAULTS or SCG_CONTEXT_SWITCHES counter of the interrupted stack, as
+ * the SIGPROF handler does SCG_SAMPLES.
+ *
+ * A page fault is signalled on return to the faulting code, so its stack is
+ * the one that touched the page.  A context switch is signalled when the
+ * thread next runs, so its stack is the one that blocked or was preempted.
+ * These are software events, so need no hardware PMU.
+ */
+
+unsigned long scg_fault_period;
+unsigned long scg_switch_period;
+
+/* The signal the events send.  A real-time signal, so that they queue, and
+ * with si_fd telling them apart.  */
+#define SCG_EVENT_SIGNAL (SIGRTMIN + 1)
+
+static const struct {
+    const char *     variable;  /* Environment variable giving the period.  */
+    unsigned         config;    /* PERF_COUNT_SW_...  */
+    enum scg_counter counter;
+    unsigned long *  period;
+} events[] = {
+    { "SCG_FAULTS", PERF_COUNT_SW_PAGE_FAULTS, SCG_PAGE_FAULTS,
+      &scg_fault_period },
+    { "SCG_SWITCHES", PERF_COUNT_SW_CONTEXT_SWITCHES, SCG_CONTEXT_SWITCHES,
+      &scg_switch_period },
+};
+
+#define EVENTS (sizeof events / sizeof events[0])
+
+/* This thread's event file descriptors, or -1.  */
+static __thread int event_fds[EVENTS] = { -1, -1 };
+
+/* Set once we have said that an event could not be opened.  */
+static int event_warned[EVENTS];
+
+/* Has a destructor closing a thread's events when it exits.  */
+static pthread_key_t event_key;
+
+
+static void scg_event_handler (int signal, siginfo_t * info, void * p)
+{
+    static __thread scg_node_t * new_node = NULL;
+    int saved_errno = errno;
+
+    for (size_t i = 0; i != EVENTS; ++i) {
+        if (event_fds[i] < 0 || info->si_fd != event_fds[i])
+            continue;
+
+        /* Skip scg_stack_node, me and __restore_rt.  */
+        scg_node_t * node = scg_stack_node (3, &new_node);
+        if (node != NULL)
+            __atomic_add_fetch (&node->counters[events[i].counter],
+                                *events[i].period, __ATOMIC_RELAXED);
+
+        /* The event disables itself after each signal.  */
+        ioctl (event_fds[i], PERF_EVENT_IOC_REFRESH, 1);
+        break;
+    }
+
+    errno = saved_errno;
+}
+
+static void scg_events_close (void * p)
+{
+    for (size_t i = 0; i != EVENTS; ++i) {
+        if (event_fds[i] >= 0)
+            close (event_fds[i]);
+        event_fds[i] = -1;
+    }
+}
+
+/* Open an event counting this thread, signalling it every period events.  */
+static int scg_event_open (unsigned config, unsigned long period)
+{
+    struct perf_event_attr attr;
+    memset (&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = config;
+    attr.sample_period = period;
+    attr.wakeup_events = 1;
+    attr.disabled = 1;
+
+    int fd = syscall (SYS_perf_event_open, &attr, 0, -1, -1,
+                      PERF_FLAG_FD_CLOEXEC);
+    /* Context switches happen in the kernel, so are only seen if it may be
+     * profiled; page faults in user code are seen regardless.  */
+    if (fd < 0 && errno == EACCES && config == PERF_COUNT_SW_PAGE_FAULTS) {
+        attr.exclude_kernel = 1;
+        fd = syscall (SYS_perf_event_open, &attr, 0, -1, -1,
+                      PERF_FLAG_FD_CLOEXEC);
+    }
+    if (fd < 0)
+        return -1;
+
+    struct f_owner_ex owner = { F_OWNER_TID, syscall (SYS_gettid) };
+    if (fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_ASYNC) < 0
+        || fcntl (fd, F_SETSIG, SCG_EVENT_SIGNAL) < 0
+        || fcntl (fd, F_SETOWN_EX, &owner) < 0
+        || ioctl (fd, PERF_EVENT_IOC_REFRESH, 1) < 0) {
+        close (fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+void scg_events_initialize (void)
+{
+    int wanted = 0;
+    for (size_t i = 0; i != EVENTS; ++i) {
+        const char * period = getenv (events[i].variable);
+        if (period != NULL && period[0] != 0)
+            *events[i].period = strtoul (period, NULL, 0);
+        wanted |= *events[i].period != 0;
+    }
+    if (!wanted)
+        return;
+
+    struct sigaction action;
+    action.sa_sigaction = scg_event_handler;
+    action.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigemptyset (&action.sa_mask);
+    sigaction (SCG_EVENT_SIGNAL, &action, NULL);
+
+    pthread_key_create (&event_key, scg_events_close);
+}
+
+void scg_events_thread_initialize (void)
+{
+    int opened = 0;
+    for (size_t i = 0; i != EVENTS; ++i) {
+        if (*events[i].period == 0 || event_fds[i] >= 0)
+            continue;
+
+        /* A failure only loses this thread's events; others may still open
+         * theirs.  Most likely it is the same for every thread, though, so
+         * say it once.  */
+        event_fds[i] = scg_event_open (events[i].config, *events[i].period);
+        if (event_fds[i] >= 0)
+            opened = 1;
+        else if (!__atomic_exchange_n (&event_warned[i], 1, __ATOMIC_RELAXED))
+            fprintf (stderr, "scg: Cannot open perf event for %s: %s\n",
+                     events[i].variable, strerror (errno));
+    }
+
+    if (opened)
+        pthread_setspecific (event_key, event_fds);
+}
@@ -0,0 +1,463 @@
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "node.h"
+
+/* Heap mode.
+ *
+ * With SCG_HEAP=N in the environment, about one allocation per N bytes is
+ * sampled.  Its stack goes into the same hash table as the CPU samples, and
+ * the bytes it stands for are added to the stack's SCG_ALLOC_BYTES and
+ * SCG_LIVE_BYTES counters.  So the one profile shows both where the time
+ * goes and where the memory goes, from one unwinder and one symbolization.
+ *
+ * Sampling is by bytes: each thread counts up the bytes it allocates, and the
+ * allocation that takes the count past N is sampled, standing for N bytes for
+ * each N counted.  So large allocations are always sampled, and the totals are
+ * right on average.
+ *
+ * Sampled pointers are kept in a small hash table, so that when one is freed
+ * its bytes come off SCG_LIVE_BYTES again.  Every free() looks there, without
+ * locking; only sampled allocations and their frees take the lock.
+ *
+ * The whole malloc family is wrapped, heap mode or not, and passed on to the
+ * next definition in the lookup order, so a program linking jemalloc or
+ * tcmalloc keeps using it for every call.
+ */
+
+unsigned long scg_heap_interval;
+
+/* The allocator we wrap: whatever comes after us in the lookup order, so
+ * jemalloc or tcmalloc as readily as glibc.  Found with dlsym on first use.  */
+static struct {
+    void * (* malloc) (size_t);
+    void   (* free) (void *);
+    void * (* calloc) (size_t, size_t);
+    void * (* realloc) (void *, size_t);
+    void * (* memalign) (size_t, size_t);
+    void * (* valloc) (size_t);
+    void * (* pvalloc) (size_t);
+    int    (* posix_memalign) (void **, size_t, size_t);
+    void * (* aligned_alloc) (size_t, size_t);
+    size_t (* malloc_usable_size) (void *);
+} real;
+
+/* dlsym may itself allocate, e.g., for dlerror.  Anything allocated while we
+ * are looking up the real functions comes from here instead, and is never
+ * freed.  Each block is preceded by its size.  */
+#define BOOTSTRAP_SIZE 16384
+#define BOOTSTRAP_ALIGN 16
+static char bootstrap_buffer[BOOTSTRAP_SIZE]
+    __attribute__ ((aligned (BOOTSTRAP_ALIGN)));
+static size_t bootstrap_used;
+static volatile int resolving;
+
+static int is_bootstrap (const void * ptr)
+{
+    return (const char *) ptr >= bootstrap_buffer
+        && (const char *) ptr < bootstrap_buffer + BOOTSTRAP_SIZE;
+}
+
+static void * bootstrap_alloc (size_t boundary, size_t size)
+{
+    if (boundary < BOOTSTRAP_ALIGN)
+        boundary = BOOTSTRAP_ALIGN;
+
+    /* Leave room for the size before the block.  */
+    size_t start = __atomic_load_n (&bootstrap_used, __ATOMIC_RELAXED);
+    size_t offset;
+    do {
+        offset = (start + BOOTSTRAP_ALIGN + boundary - 1) & -boundary;
+        if (offset > BOOTSTRAP_SIZE || size > BOOTSTRAP_SIZE - offset)
+            return NULL;
+    }
+    while (!__atomic_compare_exchange_n (&bootstrap_used, &start,
+                                         offset + size, 0, __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED));
+
+    /* The buffer is static so already zero, as calloc needs.  */
+    ((size_t *) (bootstrap_buffer + offset))[-1] = size;
+    return bootstrap_buffer + offset;
+}
+
+static size_t bootstrap_size (const void * ptr)
+{
+    return ((const size_t *) ptr)[-1];
+}
+
+static void * resolve (const char * name)
+{
+    void * function = dlsym (RTLD_NEXT, name);
+    if (function == NULL) {
+        const char * error = dlerror();
+        write (2, "scg: cannot find ", 17);
+        write (2, name, strlen (name));
+        write (2, ": ", 2);
+        write (2, error ? error : "", error ? strlen (error) : 0);
+        write (2, "\n", 1);
+        abort();
+    }
+    return function;
+}
+
+/* Look up the real allocator, if not yet done.  Returns zero if we are
+ * already doing so, and so should allocate from the bootstrap buffer.  */
+static int real_ready (void)
+{
+    if (__builtin_expect (
+            __atomic_load_n (&real.malloc, __ATOMIC_ACQUIRE) != NULL, 1))
+        return 1;
+
+    if (__atomic_exchange_n (&resolving, 1, __ATOMIC_ACQUIRE))
+        return 0;
+
+    /* Another thread may have finished while we looked.  */
+    if (real.malloc == NULL) {
+        real.free = resolve ("free");
+        real.calloc = resolve ("calloc");
+        real.realloc = resolve ("realloc");
+        real.memalign = resolve ("memalign");
+        real.valloc = resolve ("valloc");
+        real.pvalloc = resolve ("pvalloc");
+        real.posix_memalign = resolve ("posix_memalign");
+        real.aligned_alloc = resolve ("aligned_alloc");
+        real.malloc_usable_size = resolve ("malloc_usable_size");
+        /* Last, as it says the others are there.  */
+        __atomic_store_n (&real.malloc, resolve ("malloc"), __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n (&resolving, 0, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+/* Hash table has 65536 entries; we stop tracking frees when it is 3/4 full.  */
+#define HEAP_TABLE_ORDER 16
+#define HEAP_TABLE_SIZE (1 << HEAP_TABLE_ORDER)
+#define HEAP_TABLE_MAX (HEAP_TABLE_SIZE / 4 * 3)
+
+typedef struct heap_sample_t {
+    void * volatile pointer;    /* NULL if empty; stored last.  */
+    scg_node_t *    node;
+    unsigned long   bytes;
+} heap_sample_t;
+
+static heap_sample_t heap_table[HEAP_TABLE_SIZE];
+static volatile unsigned long heap_table_count;
+
+/* Removing a sample moves others along; this is odd while that happens, so
+ * that readers who miss can tell if they need to look again.  */
+static volatile unsigned long heap_table_sequence;
+
+static volatile int heap_table_lock;
+
+/* Bytes allocated since this thread's last sample.  */
+static __thread unsigned long heap_counted;
+
+/* Non-zero while sampling, or paused, so that allocations made while doing it
+ * are not sampled.  */
+static __thread int heap_busy;
+
+
+static const unsigned long GOLDEN_PRIME = sizeof(unsigned long) == 4
+    ? 2663455159ul : 11400714819323198549ul;
+
+static inline size_t heap_hash (const void * pointer)
+{
+    return ((unsigned long) pointer * GOLDEN_PRIME)
+        >> (sizeof (unsigned long) * 8 - HEAP_TABLE_ORDER);
+}
+
+static void heap_lock (void)
+{
+    while (__atomic_exchange_n (&heap_table_lock, 1, __ATOMIC_ACQUIRE))
+        while (heap_table_lock)
+            ;
+}
+
+static void heap_unlock (void)
+{
+    __atomic_store_n (&heap_table_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Find a pointer's slot, or NULL.  */
+static heap_sample_t * heap_find (const void * pointer)
+{
+    while (1) {
+        unsigned long sequence = __atomic_load_n (&heap_table_sequence,
+                                                  __ATOMIC_ACQUIRE);
+        for (size_t i = heap_hash (pointer);; i = (i + 1) % HEAP_TABLE_SIZE) {
+            void * p = __atomic_load_n (&heap_table[i].pointer,
+                                        __ATOMIC_ACQUIRE);
+            if (p == pointer)
+                return &heap_table[i];
+            if (p == NULL)
+                break;
+        }
+
+        /* Only a miss while samples moved along needs another look.  */
+        if (!(sequence & 1) && __atomic_load_n (&heap_table_sequence,
+                                                __ATOMIC_ACQUIRE) == sequence)
+            return NULL;
+    }
+}
+
+/* Add a sample, and its bytes to its node's live bytes.  If the table is
+ * full, the sample only counts as allocated.  */
+static void heap_insert (void * pointer, scg_node_t * node,
+                         unsigned long bytes)
+{
+    heap_lock();
+    int inserted = heap_table_count < HEAP_TABLE_MAX;
+    if (inserted) {
+        size_t i = heap_hash (pointer);
+        while (heap_table[i].pointer != NULL)
+            i = (i + 1) % HEAP_TABLE_SIZE;
+        heap_table[i].node = node;
+        heap_table[i].bytes = bytes;
+        __atomic_store_n (&heap_table[i].pointer, pointer, __ATOMIC_RELEASE);
+        ++heap_table_count;
+    }
+    heap_unlock();
+
+    if (inserted)
+        __atomic_add_fetch (&node->counters[SCG_LIVE_BYTES], bytes,
+                            __ATOMIC_RELAXED);
+}
+
+/* Remove a sample, and take its bytes off its node.  Returns whether the
+ * pointer was sampled, with its sample in *sample.  */
+static int heap_remove (const void * pointer, heap_sample_t * sample)
+{
+    if (pointer == NULL || heap_table_count == 0 || heap_find (pointer) == NULL)
+        return 0;
+
+    heap_lock();
+    heap_sample_t * slot = heap_find (pointer);
+    if (slot == NULL) {
+        heap_unlock();
+        return 0;
+    }
+    *sample = *slot;
+
+    /* Move later samples back into the hole, so that lookups need not step
+     * over deleted slots.  */
+    __atomic_add_fetch (&heap_table_sequence, 1, __ATOMIC_ACQ_REL);
+    size_t hole = slot - heap_table;
+    for (size_t i = (hole + 1) % HEAP_TABLE_SIZE; heap_table[i].pointer != NULL;
+         i = (i + 1) % HEAP_TABLE_SIZE) {
+        size_t home = heap_hash (heap_table[i].pointer);
+        /* Can it move back to the hole, i.e., is its home not after the hole
+         * (cyclically)?  */
+        if ((i - home) % HEAP_TABLE_SIZE >= (i - hole) % HEAP_TABLE_SIZE) {
+            heap_table[hole].node = heap_table[i].node;
+            heap_table[hole].bytes = heap_table[i].bytes;
+            __atomic_store_n (&heap_table[hole].pointer, heap_table[i].pointer,
+                              __ATOMIC_RELEASE);
+            hole = i;
+        }
+    }
+    __atomic_store_n (&heap_table[hole].pointer, NULL, __ATOMIC_RELEASE);
+    __atomic_add_fetch (&heap_table_sequence, 1, __ATOMIC_ACQ_REL);
+    --heap_table_count;
+    heap_unlock();
+
+    __atomic_sub_fetch (&sample->node->counters[SCG_LIVE_BYTES], sample->bytes,
+                        __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* Put a sample back, if the allocation turned out not to be freed.  */
+static void heap_restore (void * pointer, const heap_sample_t * sample)
+{
+    heap_insert (pointer, sample->node, sample->bytes);
+}
+
+/* Record a sampled allocation.  This is called directly from each allocation
+ * function, so the frames to skip are the same for all.  */
+__attribute__ ((noinline, noclone))
+static void heap_sample (void * pointer)
+{
+    static __thread scg_node_t * new_node = NULL;
+
+    unsigned long bytes = heap_counted / scg_heap_interval * scg_heap_interval;
+    heap_counted -= bytes;
+
+    ++heap_busy;
+    /* Skip scg_stack_node, me, and the allocation function.  */
+    scg_node_t * node = scg_stack_node (3, &new_node);
+    if (node != NULL) {
+        __atomic_add_fetch (&node->counters[SCG_ALLOC_BYTES], bytes,
+                            __ATOMIC_RELAXED);
+        heap_insert (pointer, node, bytes);
+    }
+    --heap_busy;
+}
+
+/* Count an allocation; is it to be sampled?  */
+static inline int heap_count (void * pointer, size_t size)
+{
+    if (scg_heap_interval == 0 || pointer == NULL || heap_busy)
+        return 0;
+
+    heap_counted += size;
+    return heap_counted >= scg_heap_interval;
+}
+
+
+void scg_heap_initialize (void)
+{
+    const char * interval = getenv ("SCG_HEAP");
+    if (interval != NULL && interval[0] != 0)
+        scg_heap_interval = strtoul (interval, NULL, 0);
+}
+
+void scg_heap_pause (void)
+{
+    ++heap_busy;
+}
+
+void scg_heap_resume (void)
+{
+    --heap_busy;
+}
+
+
+/* The allocation functions.  Until the real allocator is found, blocks come
+ * from the bootstrap buffer, and are not sampled.  */
+void * malloc (size_t size)
+{
+    if (!real_ready())
+        return bootstrap_alloc (0, size);
+
+    void * ret = real.malloc (size);
+    if (heap_count (ret, size))
+        heap_sample (ret);
+    return ret;
+}
+
+void free (void * ptr)
+{
+    /* Nothing but bootstrap blocks can exist before the real free does.  */
+    if (ptr == NULL || is_bootstrap (ptr))
+        return;
+
+    heap_sample_t sample;
+    heap_remove (ptr, &sample);
+    real.free (ptr);
+}
+
+/* We treat realloc as a free followed by a malloc.  The sample is removed
+ * before the real realloc, as after it the memory may already belong to
+ * someone else.  */
+void * realloc (void * ptr, size_t size)
+{
+    if (is_bootstrap (ptr)) {
+        /* Move it to the real allocator, if we can.  */
+        void * ret = malloc (size);
+        if (ret != NULL)
+            memcpy (ret, ptr, size < bootstrap_size (ptr)
+                    ? size : bootstrap_size (ptr));
+        return ret;
+    }
+
+    if (!real_ready())
+        return ptr == NULL ? bootstrap_alloc (0, size) : NULL;
+
+    heap_sample_t sample;
+    int sampled = heap_remove (ptr, &sample);
+    void * ret = real.realloc (ptr, size);
+    if (ret == NULL && size != 0 && sampled)
+        heap_restore (ptr, &sample);
+    else if (heap_count (ret, size))
+        heap_sample (ret);
+    return ret;
+}
+
+void * calloc (size_t n, size_t size)
+{
+    if (!real_ready()) {
+        size_t bytes;
+        return __builtin_mul_overflow (n, size, &bytes)
+            ? NULL : bootstrap_alloc (0, bytes);
+    }
+
+    void * ret = real.calloc (n, size);
+    if (heap_count (ret, n * size))
+        heap_sample (ret);
+    return ret;
+}
+
+void * memalign (size_t boundary, size_t size)
+{
+    if (!real_ready())
+        return bootstrap_alloc (boundary, size);
+
+    void * ret = real.memalign (boundary, size);
+    if (heap_count (ret, size))
+        heap_sample (ret);
+    return ret;
+}
+
+void * valloc (size_t size)
+{
+    if (!real_ready())
+        return bootstrap_alloc (sysconf (_SC_PAGESIZE), size);
+
+    void * ret = real.valloc (size);
+    if (heap_count (ret, size))
+        heap_sample (ret);
+    return ret;
+}
+
+void * pvalloc (size_t size)
+{
+    size_t page = sysconf (_SC_PAGESIZE);
+    if (!real_ready())
+        return bootstrap_alloc (page, (size + page - 1) & -page);
+
+    void * ret = real.pvalloc (size);
+    if (heap_count (ret, size))
+        heap_sample (ret);
+    return ret;
+}
+
+int posix_memalign (void ** ptr, size_t boundary, size_t size)
+{
+    if (!real_ready()) {
+        *ptr = bootstrap_alloc (boundary, size);
+        return *ptr ? 0 : ENOMEM;
+    }
+
+    int ret = real.posix_memalign (ptr, boundary, size);
+    if (ret == 0 && heap_count (*ptr, size))
+        heap_sample (*ptr);
+    return ret;
+}
+
+void * aligned_alloc (size_t boundary, size_t size)
+{
+    if (!real_ready())
+        return bootstrap_alloc (boundary, size);
+
+    void * ret = real.aligned_alloc (boundary, size);
+    if (heap_count (ret, size))
+        heap_sample (ret);
+    return ret;
+}
+
+/* Not sampled, but must know about the bootstrap buffer, and must ask the
+ * same allocator that we do.  */
+size_t malloc_usable_size (void * ptr)
+{
+    if (is_bootstrap (ptr))
+        return bootstrap_size (ptr);
+
+    if (ptr == NULL || !real_ready())
+        return 0;
+    return real.malloc_usable_size (ptr);
+}
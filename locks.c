@@ -0,0 +1,259 @@
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "node.h"
+
+/* Lock contention.
+ *
+ * With SCG_LOCKS=N in the environment, we wrap pthread_mutex_lock, the
+ * blocking pthread_rwlock functions and pthread_cond_wait, as pthread.c does
+ * pthread_create.  Each lock is first tried without blocking, and if that
+ * succeeds nothing more is done.  Otherwise we time the real call, and a wait
+ * of at least N nanoseconds adds its nanoseconds to the SCG_LOCK_WAIT counter
+ * of the caller's stack.  Condition variable waits are expected to block, so
+ * they have no fast path, and go to SCG_COND_WAIT instead.
+ *
+ * Each wait is also added to scg_lock_sites, by its stack and the lock's
+ * address, so that the profile can say which locks each call site waited
+ * for.
+ */
+
+int           scg_locks;
+unsigned long scg_lock_threshold;
+
+scg_lock_site_t scg_lock_sites[SCG_LOCK_SITES];
+
+static volatile int lock_sites_lock;
+
+/* Non-zero while recording a wait, so that locks taken while doing it are not
+ * recorded.  */
+static __thread int lock_busy;
+
+typedef int (* lock_func) (void *);
+typedef int (* timed_lock_func) (void *, const struct timespec *);
+typedef int (* cond_wait_func) (pthread_cond_t *, pthread_mutex_t *);
+typedef int (* cond_timedwait_func) (pthread_cond_t *, pthread_mutex_t *,
+                                     const struct timespec *);
+
+static lock_func           mutex_lock_real;
+static lock_func           mutex_trylock_real;
+static lock_func           rwlock_rdlock_real;
+static lock_func           rwlock_tryrdlock_real;
+static lock_func           rwlock_wrlock_real;
+static lock_func           rwlock_trywrlock_real;
+static timed_lock_func     rwlock_timedrdlock_real;
+static timed_lock_func     rwlock_timedwrlock_real;
+static cond_wait_func      cond_wait_real;
+static cond_timedwait_func cond_timedwait_real;
+
+
+static const unsigned long GOLDEN_PRIME = sizeof(unsigned long) == 4
+    ? 2663455159ul : 11400714819323198549ul;
+
+/* Find the real function, if we haven't yet.  */
+static void * real (void * volatile * function, const char * name)
+{
+    if (*function == NULL)
+        *function = dlsym (RTLD_NEXT, name);
+    return *function;
+}
+
+/* The condition variable functions have an old version for LinuxThreads
+ * binaries, which dlsym may give us; we want the current one.  */
+static void * real_cond (void * volatile * function, const char * name)
+{
+    if (*function == NULL)
+        *function = dlvsym (RTLD_NEXT, name, "GLIBC_2.3.2");
+    return real (function, name);
+}
+
+#define REAL(f, name) ((__typeof__ (f)) real ((void **) &f, name))
+#define REAL_COND(f, name) ((__typeof__ (f)) real_cond ((void **) &f, name))
+
+static inline unsigned long now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/* Add a wait to its site, unless the table is full.  */
+static void lock_site_add (scg_node_t * node, const void * lock,
+                           unsigned long nanoseconds)
+{
+    size_t i = ((unsigned long) node ^ (unsigned long) lock) * GOLDEN_PRIME
+        >> (sizeof (unsigned long) * 8 - SCG_LOCK_SITES_ORDER);
+
+    while (__atomic_exchange_n (&lock_sites_lock, 1, __ATOMIC_ACQUIRE))
+        while (lock_sites_lock)
+            ;
+
+    /* Give up after a while, rather than fill the table.  */
+    for (int probes = 0; probes != 64; ++probes, i = (i + 1) % SCG_LOCK_SITES) {
+        scg_lock_site_t * site = &scg_lock_sites[i];
+        if (site->node == NULL) {
+            site->node = node;
+            site->lock = lock;
+        }
+        else if (site->node != node || site->lock != lock)
+            continue;
+
+        ++site->waits;
+        site->nanoseconds += nanoseconds;
+        break;
+    }
+
+    __atomic_store_n (&lock_sites_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Record a wait.  This is called directly from each wrapper, so the frames to
+ * skip are the same for all.  */
+__attribute__ ((noinline, noclone))
+static void lock_sample (enum scg_counter counter, const void * lock,
+                         unsigned long start)
+{
+    static __thread scg_node_t * new_node = NULL;
+
+    unsigned long nanoseconds = now() - start;
+    if (nanoseconds < scg_lock_threshold)
+        return;
+
+    ++lock_busy;
+    /* Skip scg_stack_node, me, and the wrapper.  */
+    scg_node_t * node = scg_stack_node (3, &new_node);
+    if (node != NULL) {
+        __atomic_add_fetch (&node->counters[counter], nanoseconds,
+                            __ATOMIC_RELAXED);
+        lock_site_add (node, lock, nanoseconds);
+    }
+    --lock_busy;
+}
+
+static inline int lock_recording (void)
+{
+    return scg_locks && !lock_busy;
+}
+
+
+void scg_locks_initialize (void)
+{
+    const char * threshold = getenv ("SCG_LOCKS");
+    if (threshold != NULL && threshold[0] != 0) {
+        scg_lock_threshold = strtoul (threshold, NULL, 0);
+        scg_locks = 1;
+    }
+}
+
+
+int pthread_mutex_lock (pthread_mutex_t * mutex)
+{
+    if (!lock_recording())
+        return REAL (mutex_lock_real, "pthread_mutex_lock") (mutex);
+
+    /* Anything but EBUSY, including EOWNERDEAD, is the real answer.  */
+    int ret = REAL (mutex_trylock_real, "pthread_mutex_trylock") (mutex);
+    if (ret != EBUSY)
+        return ret;
+
+    unsigned long start = now();
+    ret = REAL (mutex_lock_real, "pthread_mutex_lock") (mutex);
+    lock_sample (SCG_LOCK_WAIT, mutex, start);
+    return ret;
+}
+
+int pthread_rwlock_rdlock (pthread_rwlock_t * rwlock)
+{
+    if (!lock_recording())
+        return REAL (rwlock_rdlock_real, "pthread_rwlock_rdlock") (rwlock);
+
+    int ret = REAL (rwlock_tryrdlock_real, "pthread_rwlock_tryrdlock") (rwlock);
+    if (ret != EBUSY)
+        return ret;
+
+    unsigned long start = now();
+    ret = REAL (rwlock_rdlock_real, "pthread_rwlock_rdlock") (rwlock);
+    lock_sample (SCG_LOCK_WAIT, rwlock, start);
+    return ret;
+}
+
+int pthread_rwlock_wrlock (pthread_rwlock_t * rwlock)
+{
+    if (!lock_recording())
+        return REAL (rwlock_wrlock_real, "pthread_rwlock_wrlock") (rwlock);
+
+    int ret = REAL (rwlock_trywrlock_real, "pthread_rwlock_trywrlock") (rwlock);
+    if (ret != EBUSY)
+        return ret;
+
+    unsigned long start = now();
+    ret = REAL (rwlock_wrlock_real, "pthread_rwlock_wrlock") (rwlock);
+    lock_sample (SCG_LOCK_WAIT, rwlock, start);
+    return ret;
+}
+
+int pthread_rwlock_timedrdlock (pthread_rwlock_t *      rwlock,
+                                const struct timespec * abstime)
+{
+    if (!lock_recording())
+        return REAL (rwlock_timedrdlock_real,
+                     "pthread_rwlock_timedrdlock") (rwlock, abstime);
+
+    int ret = REAL (rwlock_tryrdlock_real, "pthread_rwlock_tryrdlock") (rwlock);
+    if (ret != EBUSY)
+        return ret;
+
+    /* A wait that times out is still a wait.  */
+    unsigned long start = now();
+    ret = REAL (rwlock_timedrdlock_real,
+                "pthread_rwlock_timedrdlock") (rwlock, abstime);
+    lock_sample (SCG_LOCK_WAIT, rwlock, start);
+    return ret;
+}
+
+int pthread_rwlock_timedwrlock (pthread_rwlock_t *      rwlock,
+                                const struct timespec * abstime)
+{
+    if (!lock_recording())
+        return REAL (rwlock_timedwrlock_real,
+                     "pthread_rwlock_timedwrlock") (rwlock, abstime);
+
+    int ret = REAL (rwlock_trywrlock_real, "pthread_rwlock_trywrlock") (rwlock);
+    if (ret != EBUSY)
+        return ret;
+
+    unsigned long start = now();
+    ret = REAL (rwlock_timedwrlock_real,
+                "pthread_rwlock_timedwrlock") (rwlock, abstime);
+    lock_sample (SCG_LOCK_WAIT, rwlock, start);
+    return ret;
+}
+
+int pthread_cond_wait (pthread_cond_t * cond, pthread_mutex_t * mutex)
+{
+    if (!lock_recording())
+        return REAL_COND (cond_wait_real, "pthread_cond_wait") (cond, mutex);
+
+    unsigned long start = now();
+    int ret = REAL_COND (cond_wait_real, "pthread_cond_wait") (cond, mutex);
+    lock_sample (SCG_COND_WAIT, cond, start);
+    return ret;
+}
+
+int pthread_cond_timedwait (pthread_cond_t *        cond,
+                            pthread_mutex_t *       mutex,
+                            const struct timespec * abstime)
+{
+    if (!lock_recording())
+        return REAL_COND (cond_timedwait_real,
+                          "pthread_cond_timedwait") (cond, mutex, abstime);
+
+    unsigned long start = now();
+    int ret = REAL_COND (cond_timedwait_real,
+                         "pthread_cond_timedwait") (cond, mutex, abstime);
+    lock_sample (SCG_COND_WAIT, cond, start);
+    return ret;
+}
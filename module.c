@@ -0,0 +1,162 @@
+
+#include <dlfcn.h>
+#include <link.h>
+
+#include "node.h"
+#include "symboltable.h"
+
+/* Track shared objects being unloaded.
+ *
+ * We wrap dlclose(), as we do pthread_create().  Before the real dlclose(),
+ * we note where the object is and what it is called, which is cheap, as most
+ * calls only drop a reference.  If the object really goes away, the capture is
+ * retired against a new module generation, which loads its symbols, and the
+ * object's address range is recorded with that generation.
+ *
+ * Frames are tagged with the generation of the last unload covering their
+ * address.  Samples tagged with an earlier generation than the range has now
+ * can then be resolved against the unloaded object, even if something else
+ * is later mapped at the same address, and frames elsewhere are not affected
+ * by unloads at all.
+ *
+ * dlopen() needs no wrapper: an object can only be mapped over a range after
+ * whatever was there before has been unloaded, and that bumps the
+ * generation.  */
+
+volatile unsigned long scg_module_generation;
+
+/* The address ranges of unloaded objects, with the last generation at which
+ * each was unloaded.  Entries are only added, or have their generation
+ * raised, so that stack walks can read them without locking.  If it fills up,
+ * the last entry is widened to cover new ranges as well; that tags more frames
+ * than needed, but never too few.  */
+typedef struct retired_range {
+   uintptr_t     start;
+   uintptr_t     end;
+   unsigned long generation;
+} retired_range;
+
+#define RETIRED_RANGES 256
+
+static retired_range retired_ranges[RETIRED_RANGES];
+static unsigned      retired_count;
+static volatile int  retired_lock;
+
+typedef int (* dl_close) (void *);
+
+static dl_close dlclose_real;
+
+/* dl_iterate_phdr callback, checking if an object is still loaded: that is,
+ * something has the same dynamic section at the same address.  */
+static int still_loaded_1 (struct dl_phdr_info * info, size_t size, void * p)
+{
+   const struct link_map * map = p;
+
+   if (info->dlpi_addr != map->l_addr)
+      return 0;
+
+   for (int i = 0; i < info->dlpi_phnum; ++i) {
+      const ElfW(Phdr) * header = &info->dlpi_phdr[i];
+      if (header->p_type == PT_DYNAMIC
+          && (const void *) (info->dlpi_addr + header->p_vaddr) == map->l_ld)
+         return 1;
+   }
+
+   return 0;
+}
+
+unsigned long scg_module_generation_of (uintptr_t address)
+{
+   unsigned count = __atomic_load_n (&retired_count, __ATOMIC_ACQUIRE);
+   unsigned long generation = 0;
+
+   for (unsigned i = 0; i != count; ++i) {
+      const retired_range * r = &retired_ranges[i];
+      uintptr_t start = __atomic_load_n (&r->start, __ATOMIC_ACQUIRE);
+      uintptr_t end = __atomic_load_n (&r->end, __ATOMIC_ACQUIRE);
+      unsigned long g = __atomic_load_n (&r->generation, __ATOMIC_RELAXED);
+      if (address - start < end - start && g > generation)
+         generation = g;
+   }
+
+   return generation;
+}
+
+/* Record that [start, end) was unloaded at a generation.  */
+static void retire_range (uintptr_t start, uintptr_t end,
+                          unsigned long generation)
+{
+   while (__atomic_exchange_n (&retired_lock, 1, __ATOMIC_ACQUIRE))
+      while (retired_lock)
+         ;
+
+   /* Objects are usually loaded back where they were.  */
+   unsigned i;
+   for (i = 0; i != retired_count; ++i)
+      if (retired_ranges[i].start == start && retired_ranges[i].end == end)
+         break;
+
+   retired_range * r = &retired_ranges[i];
+   if (i != retired_count) {
+      __atomic_store_n (&r->generation, generation, __ATOMIC_RELEASE);
+   }
+   else if (i != RETIRED_RANGES) {
+      r->start = start;
+      r->end = end;
+      r->generation = generation;
+      __atomic_store_n (&retired_count, i + 1, __ATOMIC_RELEASE);
+   }
+   else {
+      /* Raise the generation first, so that no reader sees the wider range
+       * with the old one.  */
+      --r;
+      __atomic_store_n (&r->generation, generation, __ATOMIC_RELEASE);
+      if (start < r->start)
+         __atomic_store_n (&r->start, start, __ATOMIC_RELEASE);
+      if (end > r->end)
+         __atomic_store_n (&r->end, end, __ATOMIC_RELEASE);
+   }
+
+   __atomic_store_n (&retired_lock, 0, __ATOMIC_RELEASE);
+}
+
+int dlclose (void * handle)
+{
+   struct link_map * map;
+   int ret;
+
+   if (dlclose_real == NULL) {
+      dlclose_real = (dl_close) dlsym (RTLD_NEXT, "dlclose");
+   }
+
+   if (dlinfo (handle, RTLD_DI_LINKMAP, &map) != 0) {
+      return dlclose_real (handle);
+   }
+
+   /* Copy what we need to recognise the object afterwards.  The dynamic
+    * section is inside the object, so serves as an address to find it by.  */
+   struct link_map saved;
+   saved.l_addr = map->l_addr;
+   saved.l_ld = map->l_ld;
+
+   reflect_symtab_capture * capture
+      = reflect_symtab_capture_object (saved.l_ld);
+
+   ret = dlclose_real (handle);
+
+   if (ret == 0 && !dl_iterate_phdr (still_loaded_1, &saved)) {
+      unsigned long generation
+         = __atomic_add_fetch (&scg_module_generation, 1, __ATOMIC_RELAXED);
+      const void * start;
+      size_t size;
+      if (reflect_symtab_retire (capture, generation, &start, &size)) {
+         retire_range ((uintptr_t) start, (uintptr_t) start + size,
+                       generation);
+      }
+   }
+   else {
+      reflect_symtab_release (capture);
+   }
+
+   return ret;
+}
@@ -0,0 +1,495 @@
+
+/* mtrace overhead benchmark.
+ *
+ * Usage: mtbench [scale] [workload...]
+ *
+ * Each workload (default all of them) is run twice, in a child process of its
+ * own: once plain, and once with libmtrace.so, from the same directory as
+ * mtbench, in LD_PRELOAD.  Counts of operations are multiplied by scale
+ * (default 1).  The workloads are:
+ *
+ *   storm     one thread mallocs and frees small blocks of random sizes.
+ *   producer  two threads allocate blocks that two others free.
+ *   realloc   buffers grow by realloc, a half again at a time, then are freed.
+ *   stacks    the allocations come from 65536 distinct stacks.
+ *   heap      a large heap is kept live, with some of it replaced.
+ *
+ * For each we print allocations (malloc or realloc calls) per second, the
+ * peak resident size, and, with mtrace, how long a SIGUSR1 report took to
+ * write, measured from the signal until the report file is closed.  The
+ * children run in a scratch directory, which is removed afterwards.  */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static unsigned long scale = 1;
+
+/* Blocks kept live by each workload, so that frees are not all of the block
+ * just allocated.  */
+#define RING_SIZE 256
+
+static double now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* xorshift64, so that each run allocates the same sizes.  */
+static inline uint64_t next_random (uint64_t * state)
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+/* Touch a new block, as a real program would.  */
+static inline void * use (void * block)
+{
+  if (block == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  *(volatile char *) block = 1;
+  return block;
+}
+
+/* Each workload runs to completion, leaving in *live any blocks it wants kept
+ * over the report, and returns the number of allocations made.  */
+
+static size_t storm (void ** live)
+{
+  void *   ring[RING_SIZE] = { NULL };
+  uint64_t state = 1;
+  size_t   count = 2000000 * scale;
+
+  for (size_t i = 0; i != count; ++i) {
+    size_t slot = i % RING_SIZE;
+    free (ring[slot]);
+    ring[slot] = use (malloc (16 + next_random (&state) % 497));
+  }
+  for (size_t i = 0; i != RING_SIZE; ++i)
+    free (ring[i]);
+
+  return count;
+}
+
+/* Producers pass batches of blocks to consumers through a bounded queue.  */
+#define BATCH_SIZE 64
+#define QUEUE_SIZE 64
+#define PRODUCERS 2
+
+typedef struct Queue
+{
+  pthread_mutex_t lock;
+  pthread_cond_t  not_empty;
+  pthread_cond_t  not_full;
+  void *          batches[QUEUE_SIZE][BATCH_SIZE];
+  size_t          head;
+  size_t          count;
+  int             done;		/* Producers finished.  */
+} Queue;
+
+static Queue  queue = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER
+};
+static size_t batches_per_producer;
+
+static void * producer_thread (void * arg)
+{
+  uint64_t state = (uintptr_t) arg + 1;
+  void *   batch[BATCH_SIZE];
+
+  for (size_t i = 0; i != batches_per_producer; ++i) {
+    for (size_t j = 0; j != BATCH_SIZE; ++j)
+      batch[j] = use (malloc (16 + next_random (&state) % 241));
+
+    pthread_mutex_lock (&queue.lock);
+    while (queue.count == QUEUE_SIZE)
+      pthread_cond_wait (&queue.not_full, &queue.lock);
+    memcpy (queue.batches[(queue.head + queue.count++) % QUEUE_SIZE],
+	    batch, sizeof batch);
+    pthread_cond_signal (&queue.not_empty);
+    pthread_mutex_unlock (&queue.lock);
+  }
+
+  return NULL;
+}
+
+static void * consumer_thread (void * arg)
+{
+  void * batch[BATCH_SIZE];
+
+  while (1) {
+    pthread_mutex_lock (&queue.lock);
+    while (queue.count == 0 && !queue.done)
+      pthread_cond_wait (&queue.not_empty, &queue.lock);
+    if (queue.count == 0) {
+      pthread_mutex_unlock (&queue.lock);
+      return NULL;
+    }
+    memcpy (batch, queue.batches[queue.head], sizeof batch);
+    queue.head = (queue.head + 1) % QUEUE_SIZE;
+    --queue.count;
+    pthread_cond_signal (&queue.not_full);
+    pthread_mutex_unlock (&queue.lock);
+
+    for (size_t j = 0; j != BATCH_SIZE; ++j)
+      free (batch[j]);
+  }
+}
+
+static size_t producer (void ** live)
+{
+  pthread_t producers[PRODUCERS];
+  pthread_t consumers[PRODUCERS];
+
+  batches_per_producer = 10000 * scale;
+  for (uintptr_t i = 0; i != PRODUCERS; ++i) {
+    pthread_create (&producers[i], NULL, producer_thread, (void *) i);
+    pthread_create (&consumers[i], NULL, consumer_thread, NULL);
+  }
+
+  for (int i = 0; i != PRODUCERS; ++i)
+    pthread_join (producers[i], NULL);
+  pthread_mutex_lock (&queue.lock);
+  queue.done = 1;
+  pthread_cond_broadcast (&queue.not_empty);
+  pthread_mutex_unlock (&queue.lock);
+  for (int i = 0; i != PRODUCERS; ++i)
+    pthread_join (consumers[i], NULL);
+
+  return PRODUCERS * batches_per_producer * BATCH_SIZE;
+}
+
+/* Eight buffers grow side by side, so that they can't all grow in place.  */
+#define GROWING 8
+
+static size_t grow (void ** live)
+{
+  char * buffers[GROWING] = { NULL };
+  size_t sizes[GROWING] = { 0 };
+  size_t rounds = 20000 * scale;
+  size_t count = 0;
+
+  for (size_t i = 0; i != rounds; ++i)
+    for (size_t j = 0; j != GROWING; ++j) {
+      if (sizes[j] >= 65536) {
+	free (buffers[j]);
+	buffers[j] = NULL;
+	sizes[j] = 0;
+      }
+      sizes[j] += sizes[j] / 2 + 16;
+      buffers[j] = use (realloc (buffers[j], sizes[j]));
+      buffers[j][sizes[j] - 1] = 1;
+      ++count;
+    }
+  for (size_t j = 0; j != GROWING; ++j)
+    free (buffers[j]);
+
+  return count;
+}
+
+/* Eight levels of calls, each through one of four functions picked by two
+ * bits of the path, give 65536 distinct stacks inside the default depth.  */
+#define STACK_LEVELS 8
+
+typedef void * (* Level) (unsigned path, int level);
+
+static const Level levels[4];
+static volatile unsigned long level_calls;
+
+/* The increment after the call stops it being a tail call, which would take
+ * this frame off the stack.  */
+#define LEVEL(N)							\
+  static __attribute__ ((noinline)) void * level##N (unsigned path,	\
+						     int level)		\
+  {									\
+    void * block = level == 0 ? malloc (32)				\
+      : levels[path & 3] (path >> 2, level - 1);			\
+    ++level_calls;							\
+    return block;							\
+  }
+
+LEVEL (0)
+LEVEL (1)
+LEVEL (2)
+LEVEL (3)
+
+static const Level levels[4] = { level0, level1, level2, level3 };
+
+static size_t stacks (void ** live)
+{
+  void * ring[RING_SIZE] = { NULL };
+  size_t count = 1000000 * scale;
+
+  for (size_t i = 0; i != count; ++i) {
+    size_t   slot = i % RING_SIZE;
+    /* Visit the stacks in a scattered order.  */
+    unsigned path = (i * 40503) & 0xffff;
+    free (ring[slot]);
+    ring[slot] = use (levels[path & 3] (path >> 2, STACK_LEVELS - 1));
+  }
+  for (size_t i = 0; i != RING_SIZE; ++i)
+    free (ring[i]);
+
+  return count;
+}
+
+/* A million blocks averaging 136 bytes stay live; a million more
+ * replace random ones.  The live blocks are left for the report.  */
+static size_t heap (void ** live)
+{
+  size_t   blocks = 1000000 * scale;
+  size_t   replace = 1000000 * scale;
+  uint64_t state = 1;
+  void **  heap = malloc (blocks * sizeof (void *));
+
+  if (heap == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i != blocks; ++i)
+    heap[i] = use (malloc (16 + next_random (&state) % 241));
+  for (size_t i = 0; i != replace; ++i) {
+    size_t slot = next_random (&state) % blocks;
+    free (heap[slot]);
+    heap[slot] = use (malloc (16 + next_random (&state) % 241));
+  }
+
+  *live = heap;
+  return blocks + replace;
+}
+
+typedef struct Workload
+{
+  const char * name;
+  size_t    (* run) (void ** live);
+} Workload;
+
+static const Workload workloads[] = {
+  { "storm", storm },
+  { "producer", producer },
+  { "realloc", grow },
+  { "stacks", stacks },
+  { "heap", heap },
+};
+
+#define WORKLOADS_COUNT (sizeof workloads / sizeof workloads[0])
+
+/* Our peak resident size, in kB.  */
+static unsigned long peak_resident (void)
+{
+  FILE *        status = fopen ("/proc/self/status", "r");
+  char          line[256];
+  unsigned long kb = 0;
+
+  while (status != NULL && fgets (line, sizeof line, status))
+    if (sscanf (line, "VmHWM: %lu kB", &kb) == 1)
+      break;
+  if (status != NULL)
+    fclose (status);
+
+  return kb;
+}
+
+/* Ask mtrace for a report, and time it until the report file is closed.
+ * Without threads, mtrace only writes its report from within malloc, so we
+ * keep calling that while we wait.  */
+static double report_latency (void)
+{
+  int fd = inotify_init1 (IN_CLOEXEC);
+  if (fd == -1 || inotify_add_watch (fd, ".", IN_CLOSE_WRITE) == -1) {
+    perror ("inotify");
+    exit (EXIT_FAILURE);
+  }
+
+  double start = now();
+  raise (SIGUSR1);
+
+  struct pollfd pollfd = { fd, POLLIN, 0 };
+  while (poll (&pollfd, 1, 10) == 0)
+    free (use (malloc (1)));
+
+  double latency = now() - start;
+  close (fd);
+
+  return latency;
+}
+
+/* Run a workload in this process, and write what we found to stdout.  */
+static int child (const char * name, int traced)
+{
+  for (size_t i = 0; i != WORKLOADS_COUNT; ++i) {
+    if (strcmp (name, workloads[i].name) != 0)
+      continue;
+
+    void * live = NULL;
+    double start = now();
+    size_t count = workloads[i].run (&live);
+    double seconds = now() - start;
+    double latency = traced ? report_latency() : 0;
+
+    printf ("%.0f %lu %.6f\n", count / seconds, peak_resident(), latency);
+    free (live);
+    return 0;
+  }
+
+  fprintf (stderr, "Unknown workload %s.\n", name);
+  return EXIT_FAILURE;
+}
+
+typedef struct Result
+{
+  double        rate;		/* Allocations per second.  */
+  unsigned long resident;	/* Peak resident kB.  */
+  double        latency;	/* Report seconds.  */
+} Result;
+
+/* Run ourself on a workload, with preload (if not NULL) in LD_PRELOAD.  */
+static void run (const char * self, const char * name, const char * preload,
+		 Result * result)
+{
+  char scale_string[32];
+  int  fds[2];
+
+  snprintf (scale_string, sizeof scale_string, "%lu", scale);
+  if (pipe (fds) == -1) {
+    perror ("pipe");
+    exit (EXIT_FAILURE);
+  }
+
+  fflush (stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    dup2 (fds[1], STDOUT_FILENO);
+    close (fds[0]);
+    close (fds[1]);
+    if (preload)
+      setenv ("LD_PRELOAD", preload, 1);
+    execl (self, "mtbench", "--child", name, scale_string,
+	   preload ? "traced" : "plain", (char *) NULL);
+    perror (self);
+    _exit (EXIT_FAILURE);
+  }
+
+  close (fds[1]);
+  FILE * output = fdopen (fds[0], "r");
+  int    got = fscanf (output, "%lf %lu %lf", &result->rate,
+		       &result->resident, &result->latency);
+  fclose (output);
+
+  int status;
+  waitpid (pid, &status, 0);
+  if (got != 3 || !WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+    fprintf (stderr, "%s failed%s.\n", name, preload ? " with mtrace" : "");
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Remove the scratch directory, and the reports in it.  */
+static void remove_scratch (const char * scratch)
+{
+  DIR * dir = opendir (scratch);
+  struct dirent * entry;
+  char path[PATH_MAX];
+
+  while (dir != NULL && (entry = readdir (dir)) != NULL)
+    if (entry->d_name[0] != '.') {
+      snprintf (path, sizeof path, "%s/%s", scratch, entry->d_name);
+      unlink (path);
+    }
+  if (dir != NULL)
+    closedir (dir);
+  rmdir (scratch);
+}
+
+int main (int argc, char ** argv)
+{
+  if (argc == 5 && strcmp (argv[1], "--child") == 0) {
+    scale = strtoul (argv[3], NULL, 0);
+    return child (argv[2], strcmp (argv[4], "traced") == 0);
+  }
+
+  if (argc > 1 && isdigit (argv[1][0])) {
+    scale = strtoul (argv[1], NULL, 0);
+    --argc;
+    ++argv;
+  }
+
+  for (int j = 1; j < argc; ++j) {
+    size_t i = 0;
+    while (i != WORKLOADS_COUNT && strcmp (argv[j], workloads[i].name) != 0)
+      ++i;
+    if (i == WORKLOADS_COUNT) {
+      fprintf (stderr, "Unknown workload %s.\n", argv[j]);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* The children run in the scratch directory, so need absolute paths.  */
+  char self[PATH_MAX];
+  char preload[PATH_MAX + 16];
+  ssize_t length = readlink ("/proc/self/exe", self, sizeof self - 1);
+  if (length == -1) {
+    perror ("/proc/self/exe");
+    exit (EXIT_FAILURE);
+  }
+  self[length] = 0;
+  snprintf (preload, sizeof preload, "%.*s/libmtrace.so",
+	    (int) (strrchr (self, '/') - self), self);
+  if (access (preload, R_OK) != 0) {
+    perror (preload);
+    exit (EXIT_FAILURE);
+  }
+
+  char scratch[] = "/tmp/mtbench-XXXXXX";
+  if (mkdtemp (scratch) == NULL || chdir (scratch) != 0) {
+    perror (scratch);
+    exit (EXIT_FAILURE);
+  }
+  unsetenv ("LD_PRELOAD");
+
+  printf ("%-10s %14s %14s %9s %12s %12s %10s\n", "workload", "plain/s",
+	  "mtrace/s", "slowdown", "plain kB", "mtrace kB", "report ms");
+
+  for (size_t i = 0; i != WORKLOADS_COUNT; ++i) {
+    int wanted = argc == 1;
+    for (int j = 1; j < argc; ++j)
+      wanted |= strcmp (argv[j], workloads[i].name) == 0;
+    if (!wanted)
+      continue;
+
+    Result plain, traced;
+    run (self, workloads[i].name, NULL, &plain);
+    run (self, workloads[i].name, preload, &traced);
+
+    printf ("%-10s %14.0f %14.0f %8.1fx %12lu %12lu %10.1f\n",
+	    workloads[i].name, plain.rate, traced.rate,
+	    plain.rate / traced.rate, plain.resident, traced.resident,
+	    traced.latency * 1000);
+  }
+
+  remove_scratch (scratch);
+  return 0;
+}
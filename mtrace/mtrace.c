@@ -1,22 +1,36 @@
 
+#include <dlfcn.h>
 #include <errno.h>
 #include <execinfo.h>
+#include <fcntl.h>
+#include <link.h>
+#include <math.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "symboltable.h"
 
-/* Number of stack entries to keep for each allocation.  */
+/* Number of stack entries to keep for each allocation, by default, and at
+ * most.  MTRACE_DEPTH sets it at run time.  */
 #ifndef STACK_SIZE
 #define STACK_SIZE 10
 #endif
+#ifndef MAX_STACK_SIZE
+#define MAX_STACK_SIZE 256
+#endif
 
-/* We ignore the top STACK_ADJUST entries.  */
+/* We take STACK_ADJUST extra entries, for those inside mtrace itself.  */
 #ifndef STACK_ADJUST
-#define STACK_ADJUST 3
+#define STACK_ADJUST 4
 #endif
 
 /* Do we want thread protection?  */
@@ -34,372 +48,2427 @@
 #define POISON 0
 #endif
 
-/* Are we currently inside the memory tracing code?  */
-static int depth;
+/* Number of independently locked shards of the malloc record table.  */
+#ifndef MEM_SHARDS
+#define MEM_SHARDS 64
+#endif
+
+/* Bits of a malloc record holding the stack index; the rest hold the size.
+ * This limits the number of distinct stacks.  */
+#ifndef STACK_INDEX_BITS
+#define STACK_INDEX_BITS 24
+#endif
+
+/* Initial entries in each shard of the malloc record table.  */
+#ifndef MEM_TABLE_MIN
+#define MEM_TABLE_MIN 256
+#endif
+
+/* Buckets in the histogram of allocation lifetimes; bucket n counts lifetimes
+ * under 2^n microseconds.  The ones below SHORT_LIVED count as short-lived.  */
+#ifndef LIFETIME_BUCKETS
+#define LIFETIME_BUCKETS 32
+#endif
+#ifndef SHORT_LIVED
+#define SHORT_LIVED 11		/* 1024us.  */
+#endif
+
+/* Classes in the histogram of allocation sizes: 16 byte steps up to 128, then
+ * powers of two, with the last class taking everything over 512MB.  See
+ * size_class.  */
+#ifndef SIZE_CLASSES
+#define SIZE_CLASSES 32
+#endif
+
+/* Threads add up their heap growth locally, and only update the global total
+ * (and check for a new peak) when it changes by this much.  */
+#ifndef PEAK_GRANULARITY
+#define PEAK_GRANULARITY 65536
+#endif
+
+/* Size of the counting bloom filter of sampled pointers.  */
+#ifndef SAMPLED_FILTER_SIZE
+#define SAMPLED_FILTER_SIZE (1 << 20)
+#endif
 
+/* Per-thread variables are initial-exec, so that accessing them never calls
+ * into the dynamic linker, which may malloc.  */
 #if THREADS
 #include <pthread.h>
-static pthread_mutex_t mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#include <semaphore.h>
+#define THREAD_LOCAL __thread __attribute__ ((tls_model ("initial-exec")))
+static pthread_mutex_t report_mutex = PTHREAD_MUTEX_INITIALIZER;
 #else
+#define THREAD_LOCAL
 #define pthread_mutex_lock(X) do { } while (0)
 #define pthread_mutex_unlock(X) do { } while (0)
 #endif
 
-/* Do we need to print out a report?  */
-static volatile int need_report;
+/* Are we currently inside the memory tracing code?  This is per-thread, so
+ * that it only catches recursion, not other threads.  */
+static THREAD_LOCAL int depth;
 
-/* How many bytes are allocated?  */
-static size_t global_bytes;
+/* Do we need to print out a report, with no reporter thread to do it?  */
+static volatile int need_report;
 
 /* Generate a report.  */
 static void print_report (void);
 
-/* Declare the glibc internal malloc functions.  */
-void   __libc_free (void *ptr);
-void * __libc_calloc (size_t nmemb, size_t size);
-void * __libc_malloc (size_t size);
-void * __libc_memalign (size_t boundary, size_t size);
-void * __libc_realloc (void *ptr, size_t size);
-void * __libc_valloc (size_t size);
+/* The allocator we wrap: whatever comes after us in the lookup order, so
+ * jemalloc or tcmalloc as readily as glibc.  Found with dlsym on first use;
+ * our own allocations, e.g., for reports, come from it too.  */
+static struct {
+   void * (* malloc) (size_t);
+   void   (* free) (void *);
+   void * (* calloc) (size_t, size_t);
+   void * (* realloc) (void *, size_t);
+   void * (* memalign) (size_t, size_t);
+   void * (* valloc) (size_t);
+   int    (* posix_memalign) (void **, size_t, size_t);
+   void * (* aligned_alloc) (size_t, size_t);
+   size_t (* malloc_usable_size) (void *);
+} real;
+
+/* dlsym may itself allocate, e.g., for dlerror.  Anything allocated while we
+ * are looking up the real functions comes from here instead, and is never
+ * freed.  Each block is preceded by its size.  */
+#define BOOTSTRAP_SIZE 65536
+#define BOOTSTRAP_ALIGN 16
+static char bootstrap_buffer[BOOTSTRAP_SIZE]
+   __attribute__ ((aligned (BOOTSTRAP_ALIGN)));
+static size_t bootstrap_used;
+static volatile int resolving;
+
+static int is_bootstrap (const void * ptr)
+{
+   return (const char *) ptr >= bootstrap_buffer
+      && (const char *) ptr < bootstrap_buffer + BOOTSTRAP_SIZE;
+}
+
+static void * bootstrap_alloc (size_t boundary, size_t size)
+{
+   if (boundary < BOOTSTRAP_ALIGN)
+      boundary = BOOTSTRAP_ALIGN;
+
+   /* Leave room for the size before the block.  */
+   size_t start = __atomic_load_n (&bootstrap_used, __ATOMIC_RELAXED);
+   size_t offset;
+   do {
+      offset = (start + BOOTSTRAP_ALIGN + boundary - 1) & -boundary;
+      if (offset > BOOTSTRAP_SIZE || size > BOOTSTRAP_SIZE - offset)
+	 return NULL;
+   }
+   while (!__atomic_compare_exchange_n (&bootstrap_used, &start,
+					offset + size, 0, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED));
+
+   /* The buffer is static so already zero, as calloc needs.  */
+   ((size_t *) (bootstrap_buffer + offset))[-1] = size;
+   return bootstrap_buffer + offset;
+}
+
+static size_t bootstrap_size (const void * ptr)
+{
+   return ((const size_t *) ptr)[-1];
+}
+
+static void * resolve (const char * name)
+{
+   void * function = dlsym (RTLD_NEXT, name);
+   if (function == NULL) {
+      dprintf (STDERR_FILENO, "mtrace: Cannot find %s: %s\n", name,
+	       dlerror());
+      abort();
+   }
+   return function;
+}
+
+/* Look up the real allocator, if not yet done.  Returns zero if we are
+ * already doing so, and so should allocate from the bootstrap buffer.  */
+static int real_ready (void)
+{
+   if (__builtin_expect (
+	  __atomic_load_n (&real.malloc, __ATOMIC_ACQUIRE) != NULL, 1))
+      return 1;
+
+   if (__atomic_exchange_n (&resolving, 1, __ATOMIC_ACQUIRE))
+      return 0;
+
+   /* Another thread may have finished while we looked.  */
+   if (real.malloc == NULL) {
+      real.free = resolve ("free");
+      real.calloc = resolve ("calloc");
+      real.realloc = resolve ("realloc");
+      real.memalign = resolve ("memalign");
+      real.valloc = resolve ("valloc");
+      real.posix_memalign = resolve ("posix_memalign");
+      real.aligned_alloc = resolve ("aligned_alloc");
+      real.malloc_usable_size = resolve ("malloc_usable_size");
+      /* Last, as it says the others are there.  */
+      __atomic_store_n (&real.malloc, resolve ("malloc"), __ATOMIC_RELEASE);
+   }
+
+   __atomic_store_n (&resolving, 0, __ATOMIC_RELEASE);
+   return 1;
+}
+
+void * __sbrk (intptr_t increment);
+
+/* Our own mappings are made by system call, not through the mmap wrappers
+ * below, so that they are never traced.  */
+static void * sys_mmap (void * address, size_t length, int prot, int flags,
+			int fd, off_t offset)
+{
+#ifdef SYS_mmap2
+   return (void *) syscall (SYS_mmap2, address, length, prot, flags, fd,
+			    offset >> 12);
+#else
+   return (void *) syscall (SYS_mmap, address, length, prot, flags, fd, offset);
+#endif
+}
+
+static int sys_munmap (void * address, size_t length)
+{
+   return syscall (SYS_munmap, address, length);
+}
+
+static void * sys_mremap (void * old_address, size_t old_size, size_t new_size,
+			  int flags, void * new_address)
+{
+   return (void *) syscall (SYS_mremap, old_address, old_size, new_size, flags,
+			    new_address);
+}
 
 /******************************************************************************
  * Locking functions
  *
- * enter() locks, leave() unlocks.  These give us thread protection, and also
- * enable us to detect recursive calls due to memory usage with the memory
- * tracer.  Also print the report if needed.
+ * enter() and leave() bracket the memory tracing code.  There is no global
+ * lock: the tables below do their own (fine-grained) locking.  The thread-local
+ * depth lets us detect recursive calls due to memory usage within the memory
+ * tracer.  Also print the report if needed; only one thread picks that up.
+ * That only happens without a reporter thread.
  *****************************************************************************/
 static inline void enter (void)
 {
-   pthread_mutex_lock (&mutex);
    ++depth;
-   if (need_report)
+   if (need_report && depth == 1
+       && __atomic_exchange_n (&need_report, 0, __ATOMIC_ACQUIRE))
       print_report();
 }
 
 static inline void leave (void)
 {
    --depth;
-   pthread_mutex_unlock (&mutex);
 }
 
 /******************************************************************************
- * The hash table of stack traces.
+ * Record pools.
  *
- * Each entry in the hash table corresponds to a stack trace.  Each entry
- * tracks of the number of bytes allocated against that stack trace.
+ * Our own records come from mmap'd pools, not malloc, so that tracing does not
+ * perturb the heap being traced.  Each pool reserves one region of address
+ * space (MAP_NORESERVE, so pages are only committed when touched), which
+ * threads carve into slabs.  Each thread keeps its own free list; when that
+ * grows too long a batch of items moves to a shared list, for any thread to
+ * take.  So the common case takes no locks, and memory freed on one thread
+ * and allocated on another still gets reused.  When a thread exits, its free
+ * list and the rest of its slab go to the shared list as one batch.
  *****************************************************************************/
-typedef struct StackTrace
-{
-   struct StackTrace *  next;	/* Linked list structure. */
-   struct StackTrace ** prevnext;
+#define POOL_SLAB  65536	/* Bytes carved off at a time.  */
+#define POOL_BATCH 256		/* Items moved between threads at a time.  */
+
+typedef struct PoolItem {
+   struct PoolItem * next;	/* Next in free list.  */
+   struct PoolItem * batch;	/* Next batch in shared list.  */
+   size_t            count;	/* Items in the batch.  */
+} PoolItem;
+
+typedef struct Pool {
+   size_t          item_size;
+   size_t          reserve;	/* Bytes of address space.  */
+   char *          base;	/* The region, mapped on first use.  */
+   size_t          used;	/* Bytes carved off (atomic).  */
+#if THREADS
+   pthread_mutex_t lock;
+#endif
+   PoolItem *      batches;	/* Shared batches of free items.  */
+} Pool;
 
-   ssize_t     bytes;		/* Bytes outstanding on this stack. */
-   size_t      refs;		/* Reference count.  */
-   const void * stack [STACK_SIZE]; /* Stack trace (NULL padded). */
-} StackTrace;
+typedef struct PoolCache {
+   PoolItem * free;		/* This thread's free items.  */
+   size_t     count;
+   char *     next;		/* Rest of this thread's slab.  */
+   char *     end;
+} PoolCache;
 
-/* The hash table.  */
-#define STACK_HASH_SIZE 786433
-static StackTrace * stack_hash[STACK_HASH_SIZE];
+#if THREADS
+#define POOL_INITIALIZER(type, size) \
+   { sizeof (type), size, NULL, 0, PTHREAD_MUTEX_INITIALIZER, NULL }
+#else
+#define POOL_INITIALIZER(type, size) { sizeof (type), size, NULL, 0, NULL }
+#endif
 
-/******************************************************************************
- * account
- *
- * Optionally round-up a byte count to approximately account for the overheads
- * that malloc has in normal operation.
- *****************************************************************************/
-static inline size_t account (size_t n)
+#if THREADS
+static void pool_thread_exit (void * unused);
+
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static THREAD_LOCAL int pool_thread_registered;
+
+static void pool_key_create (void)
 {
-#if OVERHEADS
-   /* Add 8 and round up to a multiple of 8.  This approximates the normal
-    * overhead from the glibc malloc. */
-   return ((n) + 8 + 7) & -8;
+   pthread_key_create (&pool_key, pool_thread_exit);
+}
+
+/* Arrange for pool_thread_exit to be called when this thread exits.  */
+static void pool_thread_register (void)
+{
+   if (pool_thread_registered)
+      return;
+   pool_thread_registered = 1;
+   pthread_once (&pool_key_once, pool_key_create);
+   pthread_setspecific (pool_key, (void *) 1);
+}
 #else
-   return n;
+static void pool_thread_register (void) { }
 #endif
+
+/* Get the pool's region, mapping it if need be.  */
+static char * pool_base (Pool * pool)
+{
+   char * base = __atomic_load_n (&pool->base, __ATOMIC_ACQUIRE);
+   if (base != NULL)
+      return base;
+
+   char * region = sys_mmap (NULL, pool->reserve, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if (region == MAP_FAILED)
+      return NULL;
+
+   if (__atomic_compare_exchange_n (&pool->base, &base, region, 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return region;
+
+   /* Another thread mapped it first.  */
+   sys_munmap (region, pool->reserve);
+   return base;
 }
 
-/******************************************************************************
- * The malloc records.
- *
- * We track malloc'd memory in a hash table.
- *****************************************************************************/
-typedef struct MemRecord {
-   struct MemRecord * next;
-   void *             memory;
-   StackTrace *       stack;
-   size_t             refs;
-   size_t             bytes;
-} MemRecord;
+static void * pool_alloc (Pool * pool, PoolCache * cache)
+{
+   if (cache->free == NULL && cache->next == cache->end) {
+      pool_thread_register();
+
+      /* Take a shared batch if there is one...  */
+      pthread_mutex_lock (&pool->lock);
+      PoolItem * batch = pool->batches;
+      if (batch != NULL)
+	 pool->batches = batch->batch;
+      pthread_mutex_unlock (&pool->lock);
+
+      if (batch != NULL) {
+	 cache->free = batch;
+	 cache->count = batch->count;
+      }
+      else {
+	 /* ...else a new slab.  Slabs are a whole number of items, so every
+	  * item is at a multiple of the item size from the base.  */
+	 char * base = pool_base (pool);
+	 if (base == NULL)
+	    return NULL;
+	 size_t slab = POOL_SLAB / pool->item_size * pool->item_size;
+	 size_t offset = __atomic_fetch_add (&pool->used, slab,
+					     __ATOMIC_RELAXED);
+	 if (offset + slab > pool->reserve)
+	    return NULL;	/* Out of space.  */
+	 cache->next = base + offset;
+	 cache->end = cache->next + slab;
+      }
+   }
 
-#define MEM_HASH_SIZE 12582917
-static MemRecord * mem_hash[MEM_HASH_SIZE];
+   if (cache->free != NULL) {
+      PoolItem * item = cache->free;
+      cache->free = item->next;
+      --cache->count;
+      return item;
+   }
 
-/* Calculate the hash bucket for a pointer.  */
-static inline MemRecord ** mem_bucket (void * p)
-{
-   return &mem_hash [((size_t)(p)) % MEM_HASH_SIZE];
+   void * item = cache->next;
+   cache->next += pool->item_size;
+   return item;
 }
 
-/******************************************************************************
- * free StackTrace and MemRecord items.
- *
- *****************************************************************************/
-static inline void free_StackTrace (StackTrace * p)
+static void pool_free (Pool * pool, PoolCache * cache, void * p)
 {
-   StackTrace * next = p->next;
-   *p->prevnext = next;
-   if (next)
-      next->prevnext = p->prevnext;
-   __libc_free (p);
+   PoolItem * item = p;
+   item->next = cache->free;
+   cache->free = item;
+
+   if (++cache->count < 2 * POOL_BATCH)
+      return;
+
+   /* Give a batch away.  */
+   PoolItem * last = item;
+   for (int i = 1; i != POOL_BATCH; ++i)
+      last = last->next;
+   cache->free = last->next;
+   cache->count -= POOL_BATCH;
+   last->next = NULL;
+   item->count = POOL_BATCH;
+
+   pthread_mutex_lock (&pool->lock);
+   item->batch = pool->batches;
+   pool->batches = item;
+   pthread_mutex_unlock (&pool->lock);
 }
-static inline void free_MemRecord (MemRecord * p, MemRecord ** pp)
+
+#if THREADS
+/* Give all of a thread's items to the shared list, as one batch.  */
+static void pool_flush (Pool * pool, PoolCache * cache)
 {
-   *pp = p->next;
-   __libc_free (p);
+   for (; cache->next != cache->end; cache->next += pool->item_size) {
+      PoolItem * item = (PoolItem *) cache->next;
+      item->next = cache->free;
+      cache->free = item;
+      ++cache->count;
+   }
+
+   PoolItem * item = cache->free;
+   if (item == NULL)
+      return;
+   item->count = cache->count;
+   cache->free = NULL;
+   cache->count = 0;
+
+   pthread_mutex_lock (&pool->lock);
+   item->batch = pool->batches;
+   pool->batches = item;
+   pthread_mutex_unlock (&pool->lock);
 }
+#endif
 
 /******************************************************************************
- * get_StackTrace
+ * Clock.
  *
- * Get a stack trace record for the current stack.  We discard STACK_OFFSET
- * entries off the stack.  Currently this is 3: get_StackTrace(), the recording
- * function, and the entry point.
+ * For allocation lifetimes.  clock_gettime() is in the vDSO, so no system
+ * call.
  *****************************************************************************/
-static StackTrace * get_StackTrace (void)
+static inline uint64_t now (void)
 {
-   size_t hash = 0;
-
-   /* Grab the stack trace and clear any entries off the end.  */
-   void * stack_data [STACK_SIZE + STACK_ADJUST];
-   int i = backtrace (stack_data, STACK_SIZE + STACK_ADJUST);
-   memset (stack_data + i, 0, sizeof (void*) * (STACK_SIZE + STACK_ADJUST - i));
-   void ** stack = stack_data + STACK_ADJUST;
-
-   for (int count = 0; count != STACK_SIZE; ++count)
-      hash = hash * 31 + (size_t) stack[count];
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-   /* Lookup the stacktrace in the hash chain.  */
-   StackTrace ** bucket = &stack_hash[hash % STACK_HASH_SIZE];
-   for (StackTrace * it = *bucket; it; it = it->next)
-      if (memcmp (it->stack, stack, STACK_SIZE * sizeof (void *)) == 0)
-         /* Got it.  */
-         return it;
+/* The lifetime histogram bucket for a lifetime in microseconds.  */
+static inline int lifetime_bucket (uint64_t us)
+{
+   int bucket = us ? 64 - __builtin_clzll (us) : 0;
+   return bucket < LIFETIME_BUCKETS ? bucket : LIFETIME_BUCKETS - 1;
+}
 
-   /* Allocate a new one.  Put the new item at the start of the hash bucket,
-    * expecting most objects to be short lived.  */
-   StackTrace * it = __libc_malloc (sizeof (StackTrace));
-   if (it == NULL)
-      return it;
+/* The size class for an allocation of n bytes.  Class 0 is zero bytes;
+ * classes 1 to 8 are up to 16, 32, ... 128 bytes; after that, class c is up to
+ * 2^(c-1) bytes, except that the last class has no limit.  */
+static inline int size_class (size_t n)
+{
+   if (n <= 128)
+      return (n + 15) / 16;
 
-   it->next = *bucket;
-   if (it->next)
-      it->next->prevnext = &it->next;
-   it->prevnext = bucket;
-   *bucket = it;
-   it->refs = 0;
-   it->bytes = 0;
-   memcpy (it->stack, stack, sizeof (void *) * STACK_SIZE);
+   int c = 65 - __builtin_clzll (n - 1);
+   return c < SIZE_CLASSES ? c : SIZE_CLASSES - 1;
+}
 
-   return it;
+/* The largest size in a class.  The smallest is one more than the largest in
+ * the class before.  */
+static inline size_t size_class_max (int c)
+{
+   return c <= 8 ? c * 16 : (size_t) 1 << (c - 1);
 }
 
 /******************************************************************************
- * record_malloc
+ * The trie of stack frames.
  *
- * Record a malloc (or calloc) of size 'bytes'.
+ * Stacks are stored as paths in a trie, rooted at the innermost frame (the
+ * caller of malloc), so common frames near malloc are shared.  A node is a
+ * frame address plus the node for the next frame in, and nodes are found by
+ * hashing those two.  Like the stack trace table below, the table is
+ * lock-free and nodes are never removed.
  *****************************************************************************/
-static void * record_malloc (void *  memory,
-			     size_t  bytes)
+typedef struct Frame
 {
-   enter();
-
-   /* If the allocation failed, or we're not at depth 1, then nothing to
-    * do.  */
-   if (memory == NULL || depth != 1)
-      goto out;
-
-   /* Create a record to record that allocation.  */
-   MemRecord * record = __libc_malloc (sizeof (MemRecord));
-   if (record == NULL)
-      goto out;			/* OOM : can't record.  */
+   struct Frame *       next;	/* Hash chain.  */
+   const struct Frame * parent;	/* The next frame in; NULL at the root.  */
+   const void *         address;
+   size_t               depth;	/* Frames from the root, counting this.  */
+} Frame;
 
-   /* Chuck us into the hash table.  */
-   MemRecord ** bucket = mem_bucket (memory);
-   record->next = *bucket;
-   *bucket = record;
+#define FRAME_HASH_BITS 20
+static Frame * frame_hash[1 << FRAME_HASH_BITS];
 
-   record->memory = memory;
-   record->bytes = bytes;
+static Pool frame_pool = POOL_INITIALIZER (Frame, 1UL << 32);
+static THREAD_LOCAL PoolCache frame_cache;
 
-   /* Get the stacktrace object to use.  */
-   StackTrace * it = get_StackTrace();
-   if (it != NULL) {
-      record->stack = it;
-      it->bytes += account (bytes);
-      global_bytes += account (bytes);
-      ++it->refs;
+/* Find or add the node for address called from parent.  */
+static const Frame * get_Frame (const Frame * parent, const void * address)
+{
+   uint64_t hash = ((uintptr_t) parent ^ (uintptr_t) address
+		    ^ ((uintptr_t) address >> 29)) * 0x9E3779B97F4A7C15ULL;
+   Frame ** bucket = &frame_hash[hash >> (64 - FRAME_HASH_BITS)];
+   Frame * head = __atomic_load_n (bucket, __ATOMIC_ACQUIRE);
+   for (Frame * it = head; it; it = it->next)
+      if (it->parent == parent && it->address == address)
+	 return it;
+
+   Frame * it = pool_alloc (&frame_pool, &frame_cache);
+   if (it == NULL)
+      return NULL;
+
+   it->parent = parent;
+   it->address = address;
+   it->depth = parent ? parent->depth + 1 : 1;
+
+   it->next = head;
+   while (!__atomic_compare_exchange_n (bucket, &it->next, it, 0,
+					__ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+      for (Frame * other = it->next; other != head; other = other->next)
+	 if (other->parent == parent && other->address == address) {
+	    pool_free (&frame_pool, &frame_cache, it);
+	    return other;
+	 }
+      head = it->next;
    }
-   else
-      free_MemRecord (record, bucket);
 
- out:
-   leave();
-   return memory;
+   return it;
 }
 
 /******************************************************************************
- * record_free
+ * The hash table of stack traces.
  *
- * Remove the pointer from the tables.
+ * Each entry in the hash table corresponds to a stack trace.  Each entry
+ * tracks of the number of bytes allocated against that stack trace (and how
+ * many there were at the peak), and how much churn there is: how many
+ * allocations and frees, and how long the allocations lived.
+ *
+ * A stack trace is identified by the trie node of its outermost frame.
+ *
+ * The table is lock-free: entries are only ever pushed onto the front of a
+ * hash chain, with compare-and-swap, and are never removed, so readers can walk
+ * the chains at any time.  Dead stacks cost as much as live ones, and some
+ * programs have a great many stacks, so the histograms, which are most of an
+ * entry, count in 32 bits.  They only give proportions, and a class would need
+ * four billion allocations between reports to wrap.
  *****************************************************************************/
-static void record_free (void * ptr)
+typedef struct Churn
 {
-   if (ptr == NULL)
-      return;
-
-   enter();
-
-   /* Try and find the memory record.  */
-   MemRecord * it;
-   for (MemRecord ** it_p = mem_bucket (ptr); (it = *it_p); it_p = &it->next)
-      if (it->memory == ptr) {
-	 /* Found.  */
-	 StackTrace * stack = it->stack;
-	 stack->bytes -= account (it->bytes);
-	 global_bytes -= account (it->bytes);
-#if POISON
-	 memset (ptr, 0xcd, it->bytes);
-#endif
-	 --stack->refs;
-	 if (stack->bytes == 0 && stack->refs == 0)
-	    free_StackTrace (stack);
-	 free_MemRecord (it, it_p);
+   size_t      allocs;		/* Allocations made.  */
+   size_t      frees;		/* Allocations freed.  */
+   size_t      bytes;		/* Bytes allocated in total.  */
+   size_t      remote_frees;	/* Of those, frees on another thread.  */
+   size_t      foreign_frees;	/* Frees here of other threads' allocations.  */
+   uint32_t    lifetimes [LIFETIME_BUCKETS]; /* Frees, by lifetime.  */
+} Churn;
+
+/* The sizes of the allocations made.  The most common single size is found by
+ * majority vote, which finds any size making up more than half; hits counts
+ * allocations of that size since it took the lead.  Concurrent updates may
+ * lose a little.  */
+typedef struct Sizes
+{
+   uint32_t    classes [SIZE_CLASSES]; /* Allocations, by size class.  */
+   size_t      common;		/* The most common size, give or take.  */
+   int32_t     votes;
+   uint32_t    hits;
+} Sizes;
+
+/* A stack's bytes as of the start of an epoch: see stack_add_bytes.  */
+typedef struct Snapshot
+{
+   ssize_t       bytes;		/* Bytes then, if epoch is current.  */
+   unsigned long epoch;
+} Snapshot;
 
-	 if (depth != 1)
-	    dprintf (STDERR_FILENO,
-		     "mtrace:  Recorded free at depth %i.  Maybe harmless.\n",
-		     depth);
+typedef struct StackTrace
+{
+   struct StackTrace * next;	/* Linked list structure. */
+
+   ssize_t     bytes;		/* Bytes outstanding on this stack (atomic). */
+   ssize_t     reported;	/* Bytes at the last report.  */
+   ssize_t     logged;		/* Bytes at the last timeline tick.  */
+   int         defined;		/* Is it defined in the timeline?  */
+   Snapshot    peak;		/* Bytes at the peak.  */
+   Snapshot    snapshot;	/* Bytes when the report started.  */
+   Churn       churn;		/* Since the last report (atomic).  */
+   Sizes       sizes;		/* Since the last report (atomic).  */
+   ssize_t     mapped;		/* Bytes mapped on this stack (atomic).  */
+   size_t      resident;	/* Of those, resident, while reporting.  */
+   const Frame * leaf;		/* Outermost frame; NULL if none.  */
+} StackTrace;
 
-	 leave();
-	 return;
-      }
+/* The hash table.  */
+#define STACK_HASH_SIZE 786433
+static StackTrace * stack_hash[STACK_HASH_SIZE];
 
-   /* We did not find the address.  If this happens at depth==1, it's probably
-    * and error : write an error message to stderr.  */
+/* The stacks are numbered by their position in the pool.  */
+static Pool stack_pool = POOL_INITIALIZER (
+   StackTrace, (1UL << STACK_INDEX_BITS) * sizeof (StackTrace));
+static THREAD_LOCAL PoolCache stack_cache;
 
-   if (depth == 1)
-      /* Use dprintf because that might be a bit safer than fprintf if
-       * stdio stuff is on the stack.  */
-      dprintf (STDERR_FILENO, "mtrace: Free of unknown pointer %p.\n", ptr);
+#if THREADS
+/* Return an exiting thread's records.  A later destructor may still trace,
+ * and register again.  */
+static void pool_thread_exit (void * unused)
+{
+   pool_flush (&frame_pool, &frame_cache);
+   pool_flush (&stack_pool, &stack_cache);
+   pool_thread_registered = 0;
+}
+#endif
 
-   leave();
+static inline size_t stack_index (const StackTrace * it)
+{
+   return it - (StackTrace *) stack_pool.base;
+}
 
-   return;
+static inline StackTrace * stack_at (size_t index)
+{
+   return (StackTrace *) stack_pool.base + index;
 }
 
 /******************************************************************************
- * malloc.
+ * account
  *
+ * Optionally round-up a byte count to approximately account for the overheads
+ * that malloc has in normal operation.
  *****************************************************************************/
-void * malloc (size_t size)
+static inline size_t account (size_t n)
 {
-   return record_malloc (__libc_malloc (size), size);
+#if OVERHEADS
+   /* Add 8 and round up to a multiple of 8.  This approximates the normal
+    * overhead from the glibc malloc. */
+   return ((n) + 8 + 7) & -8;
+#else
+   return n;
+#endif
 }
 
 /******************************************************************************
- * free and cfree.
+ * Peak tracking.
  *
- * cfree is an alias of free in libc, so we do that too.
+ * We keep a running total of the heap, and note each time it reaches a new
+ * peak.  Rather than copy every stack's bytes at each new peak, each peak
+ * starts a new epoch, and a stack saves its bytes when it first changes in an
+ * epoch: until then, its current bytes are its bytes at the peak.  So a new
+ * peak costs nothing but an increment, and a stack at most one extra store
+ * per peak.
+ *
+ * The total is kept per thread, and only added to the global total every
+ * PEAK_GRANULARITY bytes, so the peak is approximate to that much per thread.
+ * Concurrent changes to one stack just as a peak is reached may also be
+ * attributed to the wrong side of it.
+ *
+ * Reports take their snapshot of the stacks the same way, so that the
+ * reporter can walk the stacks while other threads carry on allocating.
  *****************************************************************************/
-void free (void * ptr)
+static ssize_t       heap_bytes;	/* Total bytes, give or take.  */
+static ssize_t       peak_bytes;	/* The highest heap_bytes.  */
+static uint64_t      peak_time;		/* When that was.  */
+static unsigned long peak_epoch;	/* Incremented at each new peak.  */
+static unsigned long report_epoch;	/* Incremented at each report.  */
+
+static THREAD_LOCAL ssize_t heap_delta;	/* Not yet in heap_bytes.  */
+
+static void heap_add (ssize_t bytes)
 {
-   record_free (ptr);
-   __libc_free (ptr);
+   heap_delta += bytes;
+   if (heap_delta > -PEAK_GRANULARITY && heap_delta < PEAK_GRANULARITY)
+      return;
+
+   ssize_t total = __atomic_add_fetch (&heap_bytes, heap_delta,
+				       __ATOMIC_RELAXED);
+   int grew = heap_delta > 0;
+   heap_delta = 0;
+   if (!grew)
+      return;
+
+   ssize_t peak = __atomic_load_n (&peak_bytes, __ATOMIC_RELAXED);
+   while (total > peak)
+      if (__atomic_compare_exchange_n (&peak_bytes, &peak, total, 1,
+				       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	 __atomic_add_fetch (&peak_epoch, 1, __ATOMIC_RELEASE);
+	 peak_time = now();
+	 break;
+      }
 }
 
-/******************************************************************************
- * realloc.
- *
- * We treat realloc as a free followed by a malloc.  Not perfect, but works.
- *****************************************************************************/
-void * realloc (void * ptr, size_t bytes)
+/* Before a stack's first change in an epoch, save its bytes.  */
+static inline void snapshot_save (Snapshot * snapshot, const ssize_t * bytes,
+				  unsigned long * epoch)
 {
-   void * ret = __libc_realloc (ptr, bytes);
-   // FIXME - this is not right if we are poisoning.
-   if (ret != NULL)
-      record_free (ptr);	/* Handles ptr == NULL.  */
-   return record_malloc (ret, bytes); /* Handles ret = NULL.  */
+   unsigned long now = __atomic_load_n (epoch, __ATOMIC_ACQUIRE);
+   unsigned long seen = __atomic_load_n (&snapshot->epoch, __ATOMIC_RELAXED);
+   if (__builtin_expect (seen != now, 0)) {
+      ssize_t before = __atomic_load_n (bytes, __ATOMIC_RELAXED);
+      if (__atomic_compare_exchange_n (&snapshot->epoch, &seen, now, 0,
+				       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	 __atomic_store_n (&snapshot->bytes, before, __ATOMIC_RELAXED);
+   }
 }
 
-/******************************************************************************
- * calloc, cfree, valloc, memalign.
- *
- * posix_memalign not done as __libc_posix_memalign not exported.
- *****************************************************************************/
-void * calloc (size_t n, size_t bytes)
+/* A stack's bytes at the start of the current epoch.  */
+static inline ssize_t snapshot_bytes (const Snapshot * snapshot,
+				      const ssize_t * bytes,
+				      const unsigned long * epoch)
 {
-   return record_malloc (__libc_calloc (n, bytes), n * bytes);
+   if (__atomic_load_n (&snapshot->epoch, __ATOMIC_RELAXED)
+       == __atomic_load_n (epoch, __ATOMIC_RELAXED))
+      return __atomic_load_n (&snapshot->bytes, __ATOMIC_RELAXED);
+   else
+      return __atomic_load_n (bytes, __ATOMIC_RELAXED);
 }
 
-void * valloc (size_t size)
+/* Add to the bytes outstanding on a stack, and the heap total.  */
+static inline void stack_add_bytes (StackTrace * it, ssize_t bytes)
 {
-   return record_malloc (__libc_valloc (size), size);
+   snapshot_save (&it->peak, &it->bytes, &peak_epoch);
+   snapshot_save (&it->snapshot, &it->bytes, &report_epoch);
+
+   __atomic_add_fetch (&it->bytes, bytes, __ATOMIC_RELAXED);
+   heap_add (bytes);
 }
 
-void * memalign (size_t boundary, size_t size)
+/* The bytes outstanding on a stack at the peak.  */
+static inline ssize_t stack_peak_bytes (StackTrace * it)
+{
+   return snapshot_bytes (&it->peak, &it->bytes, &peak_epoch);
+}
+
+/* The bytes outstanding on a stack when the current report started.  */
+static inline ssize_t stack_report_bytes (StackTrace * it)
 {
-   return record_malloc (__libc_memalign (boundary, size), size);
+   return snapshot_bytes (&it->snapshot, &it->bytes, &report_epoch);
 }
 
 /******************************************************************************
- * Aliases
+ * Sampling.
  *
- * We map C++ operator new / delete to malloc and free.  Not quite perfect, but
- * good enough in real life.  Also, instead of worrying about whether size_t is
- * unsigned int or unsigned long, we take both.
+ * With MTRACE_SAMPLE=N, only about one allocation per N bytes is recorded, as
+ * tcmalloc does.  Each thread counts down the bytes to its next sample, drawn
+ * from an exponential distribution with mean N, so every byte allocated is
+ * equally likely to be sampled.  An allocation of n bytes is then sampled with
+ * probability 1 - exp(-n/N), and is weighted by the inverse of that, so the
+ * reported totals are unbiased estimates.
+ *
+ * Sampled pointers are also entered in a counting bloom filter, so that the
+ * frees of the (many) unsampled pointers are dismissed without touching the
+ * malloc records.
  *****************************************************************************/
-#define ALIAS(s,t) __asm__ (".equiv " #s ", " #t "\n.globl " #s "\n")
 
-ALIAS (cfree, free);
-ALIAS (_Znwj, malloc);		/* new(unsigned int) */
-ALIAS (_Znaj, malloc);		/* new[](unsigned int) */
-ALIAS (_Znwm, malloc);		/* new(unsigned long) */
-ALIAS (_Znam, malloc);		/* new[](unsigned long) */
-ALIAS (_ZdlPv, free);		/* delete(void *) */
-ALIAS (_ZdaPv, free);		/* delete[](void *) */
+/* Mean bytes between samples; zero to record everything, -1 if not yet read
+ * from the environment.  */
+static ssize_t sample_interval = -1;
 
+typedef struct Sampler {
+   uint64_t random;		/* Random state; zero if not seeded.  */
+   ssize_t  countdown;		/* Bytes until the next sample.  */
+} Sampler;
 
-/******************************************************************************
- * Report data structures.
- *
- *****************************************************************************/
-typedef struct ReportItem {
-   const char * string;
-   ssize_t      bytes;
-} ReportItem;
+static THREAD_LOCAL Sampler sampler;
+
+static unsigned char sampled_filter[SAMPLED_FILTER_SIZE];
 
-static int compare_by_string (const void * a, const void * b)
+static inline ssize_t get_sample_interval (void)
 {
-   const ReportItem * aa = a;
-   const ReportItem * bb = b;
-   return strcmp (aa->string, bb->string);
+   if (__builtin_expect (sample_interval < 0, 0)) {
+      /* Racing threads all read the same value.  */
+      const char * string = getenv ("MTRACE_SAMPLE");
+      sample_interval = string ? strtoul (string, NULL, 0) : 0;
+   }
+   return sample_interval;
 }
 
-static int compare_by_bytes (const void * a, const void * b)
+/* Bytes to the next sample, exponentially distributed.  */
+static ssize_t next_sample (Sampler * s)
 {
-   const ReportItem * aa = a;
-   const ReportItem * bb = b;
-   if (aa->bytes == bb->bytes)
-      return 0;
+   /* xorshift64*.  */
+   s->random ^= s->random >> 12;
+   s->random ^= s->random << 25;
+   s->random ^= s->random >> 27;
+   double u = ((s->random * 0x2545F4914F6CDD1DULL >> 11) + 1) * 0x1p-53;
+   return (ssize_t) (-log (u) * sample_interval) + 1;
+}
+
+/* Should an allocation of n bytes be sampled?  */
+static inline int should_sample (size_t n)
+{
+   Sampler * s = &sampler;
+   if (__builtin_expect (s->random == 0, 0)) {
+      /* Seed from the thread and the number of threads seen so far.  */
+      static uint64_t seeds;
+      uint64_t seed = (uintptr_t) s
+         + __atomic_add_fetch (&seeds, 0x9E3779B97F4A7C15ULL, __ATOMIC_RELAXED);
+      seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+      s->random = (seed ^ (seed >> 31)) | 1;
+      s->countdown = next_sample (s);
+   }
+
+   s->countdown -= n;
+   if (__builtin_expect (s->countdown > 0, 1))
+      return 0;
+
+   s->countdown = next_sample (s);
+   return 1;
+}
+
+/* The estimated bytes allocated, for a recorded allocation of n bytes.  */
+static inline ssize_t sample_weight (size_t n)
+{
+   if (sample_interval <= 0)
+      return n;
+   return n / -expm1 (-(double) n / sample_interval);
+}
+
+/* The estimated number of allocations, for a recorded allocation of n bytes.  */
+static inline size_t sample_count (size_t n)
+{
+   if (sample_interval <= 0)
+      return 1;
+   return 1 / -expm1 (-(double) n / sample_interval) + 0.5;
+}
+
+/* The two filter counters for a pointer.  */
+static inline unsigned char * filter_counter (void * p, int i)
+{
+   uint64_t hash = ((uintptr_t) p >> 4) * 0x9E3779B97F4A7C15ULL;
+   return &sampled_filter [(i ? hash >> 32 : hash >> 8) % SAMPLED_FILTER_SIZE];
+}
+
+/* Counters stick at 255, as we no longer know how many pointers they hold.  */
+static void filter_add (void * p)
+{
+   for (int i = 0; i != 2; ++i) {
+      unsigned char * counter = filter_counter (p, i);
+      unsigned char c = __atomic_load_n (counter, __ATOMIC_RELAXED);
+      while (c != 255 && !__atomic_compare_exchange_n (
+                counter, &c, c + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+   }
+}
+
+static void filter_remove (void * p)
+{
+   for (int i = 0; i != 2; ++i) {
+      unsigned char * counter = filter_counter (p, i);
+      unsigned char c = __atomic_load_n (counter, __ATOMIC_RELAXED);
+      while (c != 255 && c != 0 && !__atomic_compare_exchange_n (
+                counter, &c, c - 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+   }
+}
+
+/* Might p have been sampled?  */
+static inline int filter_contains (void * p)
+{
+   return *filter_counter (p, 0) != 0 && *filter_counter (p, 1) != 0;
+}
+
+/******************************************************************************
+ * The malloc records.
+ *
+ * We track malloc'd memory in a hash table keyed by pointer, split between
+ * MEM_SHARDS shards, each with its own lock and its own count of outstanding
+ * bytes, so that threads only contend when they hit the same shard.
+ *
+ * Each shard is an open-addressing table with linear probing, so that a lookup
+ * usually touches one cache line: an entry holds the size and stack index
+ * inline.  A table starts small and doubles when it gets too full.  The move
+ * to the new table is incremental: each operation on the shard moves a few
+ * entries from the old one, so no single malloc pays for the whole move.
+ * Tables are mmap'd, so the memory used follows the live allocations.
+ *
+ * Nothing that might call malloc is done with a shard locked.
+ *****************************************************************************/
+typedef struct MemEntry {
+   void *   memory;		/* NULL if empty, MEM_DELETED if deleted.  */
+   uint64_t stack : STACK_INDEX_BITS;
+   uint64_t bytes : 64 - STACK_INDEX_BITS;
+   uint64_t time : 48;		/* When allocated, in microseconds.  */
+   uint64_t thread : 16;	/* Which thread allocated it.  */
+} MemEntry;
+
+#define MEM_DELETED ((void *) 1)
+#define MEM_BYTES_MAX ((1UL << (64 - STACK_INDEX_BITS)) - 1)
+
+/* Entries moved from the old table per operation.  The old table must be empty
+ * before the new one is 3/4 full, so mem_reserve sizes the new table for the
+ * inserts that can happen while the old one is emptied.  */
+#define MEM_MOVE_STEP 4
+
+typedef struct MemShard {
+#if THREADS
+   pthread_mutex_t lock;
+#endif
+   MemEntry *      table;	/* Size is a power of two.  */
+   size_t          size;
+   size_t          used;	/* Live and deleted entries.  */
+   size_t          live;
+
+   MemEntry *      old_table;	/* Being emptied into table.  */
+   size_t          old_size;
+   size_t          moved;	/* Entries of old_table done.  */
+} __attribute__ ((aligned (64))) MemShard;
+
+static MemShard mem_shards[MEM_SHARDS] = {
+#if THREADS
+   [0 ... MEM_SHARDS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+#endif
+};
+
+/* Multiplicative hash of a pointer.  The top bits index the table, and some
+ * lower (but still well mixed) ones pick the shard.  */
+static inline uint64_t mem_hash (void * p)
+{
+   return (uintptr_t) p * 0x9E3779B97F4A7C15ULL;
+}
+
+static inline MemShard * mem_shard (void * p)
+{
+   return &mem_shards [(mem_hash (p) >> 30) % MEM_SHARDS];
+}
+
+static MemEntry * mem_map_table (size_t size)
+{
+   void * table = sys_mmap (NULL, size * sizeof (MemEntry),
+			    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			    -1, 0);
+   return table == MAP_FAILED ? NULL : table;
+}
+
+/* Find p in a table; else return the slot to put it in, or NULL if the table
+ * has none.  */
+static MemEntry * mem_probe (MemEntry * table, size_t size, void * p)
+{
+   size_t mask = size - 1;
+   size_t i = mem_hash (p) >> (64 - __builtin_ctzl (size));
+   MemEntry * free_slot = NULL;
+
+   for (size_t n = 0; n != size; ++n, i = (i + 1) & mask) {
+      MemEntry * e = &table[i];
+      if (e->memory == p)
+	 return e;
+      if (e->memory == NULL)
+	 return free_slot ? free_slot : e;
+      if (e->memory == MEM_DELETED && free_slot == NULL)
+	 free_slot = e;
+   }
+   return free_slot;
+}
+
+/* Move a few entries from the old table, if any.  Returns zero if the new
+ * table is full, which mem_reserve's sizing should prevent.  */
+static int mem_move_some (MemShard * shard)
+{
+   if (shard->old_table == NULL)
+      return 1;
+
+   size_t end = shard->moved + MEM_MOVE_STEP;
+   if (end > shard->old_size)
+      end = shard->old_size;
+
+   for (; shard->moved != end; ++shard->moved) {
+      MemEntry * e = &shard->old_table[shard->moved];
+      if (e->memory == NULL || e->memory == MEM_DELETED)
+	 continue;
+      MemEntry * slot = mem_probe (shard->table, shard->size, e->memory);
+      if (slot == NULL)
+	 return 0;
+      if (slot->memory == NULL)
+	 ++shard->used;
+      *slot = *e;
+      e->memory = MEM_DELETED;	/* So later lookups don't find it here.  */
+   }
+
+   if (shard->moved == shard->old_size) {
+      sys_munmap (shard->old_table, shard->old_size * sizeof (MemEntry));
+      shard->old_table = NULL;
+   }
+   return 1;
+}
+
+/* Make room for one more entry.  Returns zero if we can't.  */
+static int mem_reserve (MemShard * shard)
+{
+   if (shard->table != NULL && (shard->used + 1) * 4 <= shard->size * 3)
+      return 1;
+
+   /* Finish any previous move first; it is nearly done anyway.  */
+   while (shard->old_table != NULL)
+      if (!mem_move_some (shard))
+	 return 0;
+
+   /* Double, unless it's full of deleted entries, so shrink.  Each operation
+    * while the current table is emptied into the new one adds at most one
+    * entry, and that must leave it under 3/4 full.  So a shrink can only
+    * halve the size or so at a time.  */
+   size_t most = shard->live + shard->size / MEM_MOVE_STEP + 1;
+   size_t size = MEM_TABLE_MIN;
+   while (size < shard->live * 2 || size * 3 < most * 4)
+      size *= 2;
+
+   MemEntry * table = mem_map_table (size);
+   if (table == NULL)
+      return 0;
+
+   shard->old_table = shard->table;
+   shard->old_size = shard->size;
+   shard->moved = 0;
+   shard->table = table;
+   shard->size = size;
+   shard->used = 0;
+   if (shard->old_table == NULL)
+      shard->old_size = 0;
+
+   mem_move_some (shard);
+   return 1;
+}
+
+/* Add p to the table.  If it's already there, a free went unseen, and the
+ * stale entry is returned in *stale.  Returns zero if out of memory.  */
+static int mem_insert (MemShard * shard, void * p, size_t stack, size_t bytes,
+		       uint64_t time, unsigned thread, MemEntry * stale)
+{
+   stale->memory = NULL;
+
+   if (!mem_reserve (shard) || !mem_move_some (shard))
+      return 0;
+
+   if (shard->old_table != NULL) {
+      MemEntry * e = mem_probe (shard->old_table, shard->old_size, p);
+      if (e != NULL && e->memory == p) {
+	 *stale = *e;
+	 e->memory = MEM_DELETED;
+	 --shard->live;
+      }
+   }
+
+   MemEntry * e = mem_probe (shard->table, shard->size, p);
+   if (e == NULL)
+      return 0;
+   if (e->memory == p) {
+      *stale = *e;
+      --shard->live;
+   }
+   else if (e->memory == NULL)
+      ++shard->used;
+
+   e->memory = p;
+   e->stack = stack;
+   e->bytes = bytes;
+   e->time = time;
+   e->thread = thread;
+   ++shard->live;
+   return 1;
+}
+
+/* Remove p from the table, returning its entry.  Returns zero if not found.  */
+static int mem_remove (MemShard * shard, void * p, MemEntry * found)
+{
+   if (shard->table == NULL)
+      return 0;
+
+   mem_move_some (shard);
+
+   MemEntry * e = mem_probe (shard->table, shard->size, p);
+   if ((e == NULL || e->memory != p) && shard->old_table != NULL)
+      e = mem_probe (shard->old_table, shard->old_size, p);
+   if (e == NULL || e->memory != p)
+      return 0;
+
+   *found = *e;
+   e->memory = MEM_DELETED;
+   --shard->live;
+   return 1;
+}
+
+/******************************************************************************
+ * get_StackTrace
+ *
+ * Get a stack trace record for the current stack.  We discard the entries
+ * inside mtrace itself, found by address, as inlining and tail calls make
+ * their number vary.
+ *****************************************************************************/
+
+/* Our own code, from the ELF header to the end of .text.  Hidden, so these
+ * are ours and not the program's.  */
+extern const char __ehdr_start[] __attribute__ ((visibility ("hidden")));
+extern const char __etext[] __attribute__ ((visibility ("hidden")));
+
+/* Frames to keep; zero if not yet read from the environment.  */
+static int stack_depth;
+
+static inline int get_stack_depth (void)
+{
+   if (__builtin_expect (stack_depth == 0, 0)) {
+      const char * string = getenv ("MTRACE_DEPTH");
+      int depth = string ? atoi (string) : STACK_SIZE;
+      stack_depth = depth < 1 ? 1 : depth > MAX_STACK_SIZE ? MAX_STACK_SIZE
+	 : depth;
+   }
+   return stack_depth;
+}
+
+static StackTrace * __attribute__ ((noinline)) get_StackTrace (void)
+{
+   /* Grab the stack trace, and skip our own frames.  */
+   void * stack [MAX_STACK_SIZE + STACK_ADJUST];
+   int count = backtrace (stack, get_stack_depth() + STACK_ADJUST);
+   int first = 0;
+   while (first != count && (const char *) stack[first] >= __ehdr_start
+	  && (const char *) stack[first] < __etext)
+      ++first;
+   if (count - first > stack_depth)
+      count = first + stack_depth;
+
+   /* Find the stack's path in the trie.  */
+   const Frame * leaf = NULL;
+   for (int i = first; i != count; ++i) {
+      leaf = get_Frame (leaf, stack[i]);
+      if (leaf == NULL)
+	 return NULL;
+   }
+
+   /* Lookup the stacktrace in the hash chain.  */
+   size_t hash = (uintptr_t) leaf * 0x9E3779B97F4A7C15ULL >> 16;
+   StackTrace ** bucket = &stack_hash[hash % STACK_HASH_SIZE];
+   StackTrace * head = __atomic_load_n (bucket, __ATOMIC_ACQUIRE);
+   for (StackTrace * it = head; it; it = it->next)
+      if (it->leaf == leaf)
+         /* Got it.  */
+         return it;
+
+   /* Allocate a new one.  Put the new item at the start of the hash bucket.  */
+   StackTrace * it = pool_alloc (&stack_pool, &stack_cache);
+   if (it == NULL)
+      return it;
+
+   it->bytes = 0;
+   it->reported = 0;
+   it->logged = 0;
+   it->defined = 0;
+   /* We didn't exist at the last peak, or when any report started.  */
+   it->peak.bytes = 0;
+   it->peak.epoch = __atomic_load_n (&peak_epoch, __ATOMIC_ACQUIRE);
+   it->snapshot.bytes = 0;
+   it->snapshot.epoch = __atomic_load_n (&report_epoch, __ATOMIC_ACQUIRE);
+   memset (&it->churn, 0, sizeof (Churn));
+   memset (&it->sizes, 0, sizeof (Sizes));
+   it->mapped = 0;
+   it->resident = 0;
+   it->leaf = leaf;
+
+   it->next = head;
+   while (!__atomic_compare_exchange_n (bucket, &it->next, it, 0,
+					__ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+      /* Another thread got in first.  If it added the same stack, use that.  */
+      for (StackTrace * other = it->next; other != head; other = other->next)
+	 if (other->leaf == leaf) {
+	    pool_free (&stack_pool, &stack_cache, it);
+	    return other;
+	 }
+      head = it->next;
+   }
+
+   return it;
+}
+
+/* Count count allocations of n bytes.  */
+static inline void sizes_add (Sizes * sizes, size_t n, size_t count)
+{
+   __atomic_add_fetch (&sizes->classes[size_class (n)], count,
+		       __ATOMIC_RELAXED);
+
+   if (n == __atomic_load_n (&sizes->common, __ATOMIC_RELAXED)) {
+      __atomic_add_fetch (&sizes->votes, count, __ATOMIC_RELAXED);
+      __atomic_add_fetch (&sizes->hits, count, __ATOMIC_RELAXED);
+   }
+   else if (__atomic_sub_fetch (&sizes->votes, count, __ATOMIC_RELAXED) < 0) {
+      /* Out-voted: this size takes the lead.  */
+      __atomic_store_n (&sizes->common, n, __ATOMIC_RELAXED);
+      __atomic_store_n (&sizes->votes, count, __ATOMIC_RELAXED);
+      __atomic_store_n (&sizes->hits, count, __ATOMIC_RELAXED);
+   }
+}
+
+/******************************************************************************
+ * Cross-thread frees.
+ *
+ * Memory allocated on one thread and freed on another defeats malloc's
+ * per-thread caches.  Each allocation records the thread that made it, and a
+ * free on another thread counts against the allocating stack.  Capturing the
+ * freeing stack costs a backtrace, so that is only done for one in
+ * CROSS_SAMPLE of each thread's cross-thread frees, which brings along the
+ * count of those since the last one.  That count goes against the freeing
+ * stack, and against the pair of them in a fixed-size, lock-free table.  The
+ * pairs show which hand-offs between threads are the busiest.
+ *
+ * A pair's slot is given up at a report if it has had no frees since the last,
+ * so that a long run does not fill the table with old pairs.
+ *****************************************************************************/
+#ifndef CROSS_PAIRS
+#define CROSS_PAIRS 65536	/* A power of two.  */
+#endif
+#define CROSS_PROBES 64
+#ifndef CROSS_SAMPLE
+#define CROSS_SAMPLE 64
+#endif
+
+typedef struct CrossPair {
+   uint64_t key;		/* The stack indexes, plus one; zero if empty.  */
+   size_t   frees;		/* Since the last report.  */
+} CrossPair;
+
+static CrossPair cross_pairs[CROSS_PAIRS];
+
+/* Threads are numbered as they first allocate.  Only the low 16 bits are
+ * recorded, so now and then a cross-thread free may be missed.  */
+static unsigned thread_count;
+static THREAD_LOCAL unsigned thread_number;
+
+static inline unsigned current_thread (void)
+{
+   if (__builtin_expect (thread_number == 0, 0))
+      thread_number = __atomic_add_fetch (&thread_count, 1, __ATOMIC_RELAXED);
+   return thread_number;
+}
+
+static inline uint64_t cross_key (size_t allocator, size_t freer)
+{
+   return ((uint64_t) allocator << STACK_INDEX_BITS | freer) + 1;
+}
+
+/* Count frees by one stack of another's allocations.  If the table is full
+ * around the pair, they only count against the stacks.  */
+static void cross_add (size_t allocator, size_t freer, size_t count)
+{
+   uint64_t key = cross_key (allocator, freer);
+   size_t i = (key * 0x9E3779B97F4A7C15ULL) >> 40;
+   for (int n = 0; n != CROSS_PROBES; ++n, ++i) {
+      CrossPair * pair = &cross_pairs[i % CROSS_PAIRS];
+      uint64_t seen = __atomic_load_n (&pair->key, __ATOMIC_RELAXED);
+      if (seen == 0
+	  && __atomic_compare_exchange_n (&pair->key, &seen, key, 0,
+					  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	 seen = key;
+      if (seen == key) {
+	 __atomic_add_fetch (&pair->frees, count, __ATOMIC_RELAXED);
+	 return;
+      }
+   }
+}
+
+/* This thread's cross-thread frees until it next captures its stack, and
+ * those since it last did.  */
+static THREAD_LOCAL unsigned cross_countdown;
+static THREAD_LOCAL size_t cross_pending;
+
+/* Count a free of stack's memory on another thread than allocated it.  */
+static void record_cross_free (StackTrace * stack, size_t count)
+{
+   __atomic_add_fetch (&stack->churn.remote_frees, count, __ATOMIC_RELAXED);
+
+   cross_pending += count;
+   if (cross_countdown != 0) {
+      --cross_countdown;
+      return;
+   }
+   cross_countdown = CROSS_SAMPLE - 1;
+
+   StackTrace * freer = get_StackTrace();
+   if (freer == NULL)
+      return;
+
+   count = cross_pending;
+   cross_pending = 0;
+   __atomic_add_fetch (&freer->churn.foreign_frees, count, __ATOMIC_RELAXED);
+   cross_add (stack_index (stack), stack_index (freer), count);
+}
+
+/******************************************************************************
+ * record_malloc
+ *
+ * Record a malloc (or calloc) of size 'bytes'.
+ *****************************************************************************/
+static void * record_malloc (void *  memory,
+			     size_t  bytes)
+{
+   enter();
+
+   /* If the allocation failed, or we're not at depth 1, or it's not
+    * sampled, then nothing to do.  */
+   if (memory == NULL || depth != 1)
+      goto out;
+
+   int sampling = get_sample_interval() != 0;
+   if (sampling && !should_sample (account (bytes)))
+      goto out;
+
+   /* Get the stacktrace object to use.  Do this before locking anything, as
+    * backtrace() may allocate memory.  */
+   StackTrace * it = get_StackTrace();
+   if (it == NULL)
+      goto out;			/* OOM : can't record.  */
+
+   /* Chuck us into the hash table.  */
+   if (bytes > MEM_BYTES_MAX)
+      bytes = MEM_BYTES_MAX;
+   MemShard * shard = mem_shard (memory);
+   MemEntry stale;
+   pthread_mutex_lock (&shard->lock);
+   uint64_t time = now() / 1000;
+   int recorded = mem_insert (shard, memory, stack_index (it), bytes, time,
+			      current_thread(), &stale);
+   pthread_mutex_unlock (&shard->lock);
+
+   if (!recorded)
+      goto out;			/* OOM : can't record.  */
+
+   if (stale.memory != NULL)
+      stack_add_bytes (stack_at (stale.stack),
+		       -sample_weight (account (stale.bytes)));
+   else if (sampling)
+      filter_add (memory);
+
+   stack_add_bytes (it, sample_weight (account (bytes)));
+   __atomic_add_fetch (&it->churn.allocs, sample_count (account (bytes)),
+		       __ATOMIC_RELAXED);
+   __atomic_add_fetch (&it->churn.bytes, sample_weight (account (bytes)),
+		       __ATOMIC_RELAXED);
+   sizes_add (&it->sizes, bytes, sample_count (account (bytes)));
+
+ out:
+   leave();
+   return memory;
+}
+
+/******************************************************************************
+ * record_free
+ *
+ * Remove the pointer from the tables.
+ *****************************************************************************/
+static void record_free (void * ptr)
+{
+   if (ptr == NULL)
+      return;
+
+   /* Unsampled pointers are (nearly) all rejected here.  */
+   int sampling = get_sample_interval() != 0;
+   if (sampling && !filter_contains (ptr))
+      return;
+
+   enter();
+
+   /* Try and find the memory record, and remove it.  */
+   MemShard * shard = mem_shard (ptr);
+   MemEntry it;
+   pthread_mutex_lock (&shard->lock);
+   int found = mem_remove (shard, ptr, &it);
+   pthread_mutex_unlock (&shard->lock);
+
+   if (found) {
+      if (sampling)
+	 filter_remove (ptr);
+      StackTrace * stack = stack_at (it.stack);
+      size_t count = sample_count (account (it.bytes));
+      stack_add_bytes (stack, -sample_weight (account (it.bytes)));
+      __atomic_add_fetch (&stack->churn.frees, count, __ATOMIC_RELAXED);
+      __atomic_add_fetch (
+	 &stack->churn.lifetimes[lifetime_bucket (now() / 1000 - it.time)],
+	 count, __ATOMIC_RELAXED);
+      if (it.thread != (current_thread() & 0xffff))
+	 record_cross_free (stack, count);
+#if POISON
+      memset (ptr, 0xcd, it.bytes);
+#endif
+
+      if (depth != 1)
+	 dprintf (STDERR_FILENO,
+		  "mtrace:  Recorded free at depth %i.  Maybe harmless.\n",
+		  depth);
+
+      leave();
+      return;
+   }
+
+   /* We did not find the address.  If this happens at depth==1, it's probably
+    * and error : write an error message to stderr.  Unless we're sampling, in
+    * which case it's a false positive from the filter.  */
+
+   if (depth == 1 && !sampling)
+      /* Use dprintf because that might be a bit safer than fprintf if
+       * stdio stuff is on the stack.  */
+      dprintf (STDERR_FILENO, "mtrace: Free of unknown pointer %p.\n", ptr);
+
+   leave();
+
+   return;
+}
+
+/******************************************************************************
+ * malloc.
+ *
+ * Until the real allocator is found, we allocate from the bootstrap buffer;
+ * those blocks are not recorded.
+ *
+ * Calls into the real allocator are made at a raised depth, as though from
+ * inside the tracer.  Allocators such as jemalloc and tcmalloc map their
+ * arenas through our mmap, and those mappings would otherwise be charged to
+ * the caller's stack, on top of the blocks carved from them.
+ *****************************************************************************/
+void * malloc (size_t size)
+{
+   if (!real_ready())
+      return bootstrap_alloc (0, size);
+
+   ++depth;
+   void * ret = real.malloc (size);
+   --depth;
+   return record_malloc (ret, size);
+}
+
+/******************************************************************************
+ * free and cfree.
+ *
+ * cfree is an alias of free in libc, so we do that too.
+ *****************************************************************************/
+void free (void * ptr)
+{
+   /* Nothing but bootstrap blocks can exist before the real free does.  */
+   if (ptr == NULL || is_bootstrap (ptr))
+      return;
+
+   record_free (ptr);
+   ++depth;
+   real.free (ptr);
+   --depth;
+}
+
+/******************************************************************************
+ * realloc.
+ *
+ * We treat realloc as a free followed by a malloc.  Not perfect, but works.
+ *****************************************************************************/
+void * realloc (void * ptr, size_t bytes)
+{
+   if (is_bootstrap (ptr)) {
+      /* Move it to the real allocator, if we can.  */
+      void * ret = malloc (bytes);
+      if (ret != NULL)
+	 memcpy (ret, ptr, bytes < bootstrap_size (ptr)
+		 ? bytes : bootstrap_size (ptr));
+      return ret;
+   }
+
+   if (!real_ready())
+      return ptr == NULL ? bootstrap_alloc (0, bytes) : NULL;
+
+   ++depth;
+   void * ret = real.realloc (ptr, bytes);
+   --depth;
+   // FIXME - this is not right if we are poisoning.
+   if (ret != NULL)
+      record_free (ptr);	/* Handles ptr == NULL.  */
+   return record_malloc (ret, bytes); /* Handles ret = NULL.  */
+}
+
+/******************************************************************************
+ * calloc, cfree, valloc, memalign, posix_memalign, aligned_alloc.
+ *
+ *****************************************************************************/
+void * calloc (size_t n, size_t bytes)
+{
+   if (!real_ready()) {
+      size_t size;
+      return __builtin_mul_overflow (n, bytes, &size)
+	 ? NULL : bootstrap_alloc (0, size);
+   }
+
+   ++depth;
+   void * ret = real.calloc (n, bytes);
+   --depth;
+   return record_malloc (ret, n * bytes);
+}
+
+void * valloc (size_t size)
+{
+   if (!real_ready())
+      return bootstrap_alloc (sysconf (_SC_PAGESIZE), size);
+
+   ++depth;
+   void * ret = real.valloc (size);
+   --depth;
+   return record_malloc (ret, size);
+}
+
+void * memalign (size_t boundary, size_t size)
+{
+   if (!real_ready())
+      return bootstrap_alloc (boundary, size);
+
+   ++depth;
+   void * ret = real.memalign (boundary, size);
+   --depth;
+   return record_malloc (ret, size);
+}
+
+int posix_memalign (void ** ptr, size_t boundary, size_t size)
+{
+   if (!real_ready()) {
+      *ptr = bootstrap_alloc (boundary, size);
+      return *ptr ? 0 : ENOMEM;
+   }
+
+   ++depth;
+   int ret = real.posix_memalign (ptr, boundary, size);
+   --depth;
+   if (ret == 0)
+      record_malloc (*ptr, size);
+   return ret;
+}
+
+void * aligned_alloc (size_t boundary, size_t size)
+{
+   if (!real_ready())
+      return bootstrap_alloc (boundary, size);
+
+   ++depth;
+   void * ret = real.aligned_alloc (boundary, size);
+   --depth;
+   return record_malloc (ret, size);
+}
+
+/******************************************************************************
+ * malloc_usable_size.
+ *
+ * Not recorded, but must know about the bootstrap buffer, and must ask the
+ * same allocator that we do.
+ *****************************************************************************/
+size_t malloc_usable_size (void * ptr)
+{
+   if (is_bootstrap (ptr))
+      return bootstrap_size (ptr);
+
+   if (ptr == NULL || !real_ready())
+      return 0;
+   return real.malloc_usable_size (ptr);
+}
+
+/******************************************************************************
+ * Aligned operator new.
+ *
+ * This takes its arguments the other way round from memalign.
+ *****************************************************************************/
+static void * __attribute__ ((used, noclone)) aligned_new (size_t size,
+							  size_t boundary)
+{
+   if (!real_ready())
+      return bootstrap_alloc (boundary, size);
+
+   ++depth;
+   void * ret = real.memalign (boundary, size);
+   --depth;
+   return record_malloc (ret, size);
+}
+
+/******************************************************************************
+ * Aliases
+ *
+ * We map C++ operator new / delete to malloc and free.  Not quite perfect, but
+ * good enough in real life.  Also, instead of worrying about whether size_t is
+ * unsigned int or unsigned long, we take both.  Extra arguments, the size
+ * passed to sized delete, and the nothrow_t tags, are just ignored.
+ *****************************************************************************/
+#define ALIAS(s,t) __asm__ (".equiv " #s ", " #t "\n.globl " #s "\n")
+
+ALIAS (cfree, free);
+ALIAS (_Znwj, malloc);		/* new(unsigned int) */
+ALIAS (_Znaj, malloc);		/* new[](unsigned int) */
+ALIAS (_Znwm, malloc);		/* new(unsigned long) */
+ALIAS (_Znam, malloc);		/* new[](unsigned long) */
+ALIAS (_ZdlPv, free);		/* delete(void *) */
+ALIAS (_ZdaPv, free);		/* delete[](void *) */
+
+ALIAS (_ZnwjRKSt9nothrow_t, malloc); /* new(unsigned int, nothrow_t) */
+ALIAS (_ZnajRKSt9nothrow_t, malloc); /* new[](unsigned int, nothrow_t) */
+ALIAS (_ZnwmRKSt9nothrow_t, malloc); /* new(unsigned long, nothrow_t) */
+ALIAS (_ZnamRKSt9nothrow_t, malloc); /* new[](unsigned long, nothrow_t) */
+ALIAS (_ZdlPvRKSt9nothrow_t, free); /* delete(void *, nothrow_t) */
+ALIAS (_ZdaPvRKSt9nothrow_t, free); /* delete[](void *, nothrow_t) */
+
+ALIAS (_ZdlPvj, free);		/* delete(void *, unsigned int) */
+ALIAS (_ZdaPvj, free);		/* delete[](void *, unsigned int) */
+ALIAS (_ZdlPvm, free);		/* delete(void *, unsigned long) */
+ALIAS (_ZdaPvm, free);		/* delete[](void *, unsigned long) */
+
+/* new(unsigned int, align_val_t) etc.  */
+ALIAS (_ZnwjSt11align_val_t, aligned_new);
+ALIAS (_ZnajSt11align_val_t, aligned_new);
+ALIAS (_ZnwmSt11align_val_t, aligned_new);
+ALIAS (_ZnamSt11align_val_t, aligned_new);
+ALIAS (_ZnwjSt11align_val_tRKSt9nothrow_t, aligned_new);
+ALIAS (_ZnajSt11align_val_tRKSt9nothrow_t, aligned_new);
+ALIAS (_ZnwmSt11align_val_tRKSt9nothrow_t, aligned_new);
+ALIAS (_ZnamSt11align_val_tRKSt9nothrow_t, aligned_new);
+
+/* delete(void *, align_val_t) etc.  */
+ALIAS (_ZdlPvSt11align_val_t, free);
+ALIAS (_ZdaPvSt11align_val_t, free);
+ALIAS (_ZdlPvSt11align_val_tRKSt9nothrow_t, free);
+ALIAS (_ZdaPvSt11align_val_tRKSt9nothrow_t, free);
+ALIAS (_ZdlPvjSt11align_val_t, free);
+ALIAS (_ZdaPvjSt11align_val_t, free);
+ALIAS (_ZdlPvmSt11align_val_t, free);
+ALIAS (_ZdaPvmSt11align_val_t, free);
+
+
+/******************************************************************************
+ * Mappings.
+ *
+ * mmap, munmap, mremap, sbrk and brk are traced too, as large buffers, arenas
+ * and mapped files are often most of a program's memory.  (malloc's own calls
+ * to them are internal to libc, so are not seen here.)  Live mappings are kept
+ * in an interval map, an array sorted by address, so that unmapping part of a
+ * mapping takes off just that part.  Each stack counts the bytes mapped on it.
+ * With MTRACE_RESIDENT set, reports also use mincore to find how much of each
+ * stack's mappings is resident.
+ *
+ * Mapping calls are system calls anyway, so one lock for the map does.  It is
+ * held across munmap and mremap themselves, so that the range cannot be mapped
+ * again, and recorded, before we take it off.
+ *****************************************************************************/
+typedef struct Mapping {
+   uintptr_t    start;
+   uintptr_t    end;
+   StackTrace * stack;
+} Mapping;
+
+#if THREADS
+static pthread_mutex_t mapping_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static Mapping * mappings;	/* Sorted by address; none overlap.  Mapped
+				 * by system call.  */
+static size_t    mapping_count;
+static size_t    mappings_size;
+
+/* Should reports find the resident bytes?  */
+static int report_resident;
+
+static size_t page_size (void)
+{
+   static size_t size;
+   if (size == 0)
+      size = sysconf (_SC_PAGESIZE);
+   return size;
+}
+
+/* The index of the first mapping ending after address.  */
+static size_t mapping_search (uintptr_t address)
+{
+   size_t low = 0;
+   size_t high = mapping_count;
+   while (low < high) {
+      size_t middle = (low + high) / 2;
+      if (mappings[middle].end <= address)
+	 low = middle + 1;
+      else
+	 high = middle;
+   }
+   return low;
+}
+
+/* Make room for one more mapping.  Returns zero if we can't.  */
+static int mapping_reserve (void)
+{
+   if (mapping_count < mappings_size)
+      return 1;
+
+   /* Not from the real allocator: it may map memory through our wrappers,
+    * and we hold mapping_mutex.  */
+   size_t size = mappings_size ? mappings_size * 2 : 256;
+   Mapping * bigger = mappings
+      ? sys_mremap (mappings, mappings_size * sizeof (Mapping),
+		    size * sizeof (Mapping), MREMAP_MAYMOVE, NULL)
+      : sys_mmap (NULL, size * sizeof (Mapping), PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (bigger == MAP_FAILED)
+      return 0;
+
+   mappings = bigger;
+   mappings_size = size;
+   return 1;
+}
+
+static inline void mapping_add_bytes (const Mapping * m, ssize_t bytes)
+{
+   __atomic_add_fetch (&m->stack->mapped, bytes, __ATOMIC_RELAXED);
+}
+
+/* Take [start, end) out of the map, splitting any mapping that spans it.  */
+static void mapping_remove (uintptr_t start, uintptr_t end)
+{
+   size_t i = mapping_search (start);
+   if (i != mapping_count && mappings[i].start < start) {
+      Mapping * m = &mappings[i];
+      if (m->end > end && mapping_reserve()) {
+	 /* A hole in the middle: split it in two.  */
+	 m = &mappings[i];
+	 memmove (m + 1, m, (mapping_count - i) * sizeof (Mapping));
+	 ++mapping_count;
+	 m[1].start = end;
+	 m->end = start;
+	 mapping_add_bytes (m, start - end);
+	 return;
+      }
+
+      /* Otherwise cut off the end.  If we couldn't split it, we lose track of
+       * the rest.  */
+      mapping_add_bytes (m, start - m->end);
+      m->end = start;
+      ++i;
+   }
+
+   size_t j = i;
+   for (; j != mapping_count && mappings[j].end <= end; ++j)
+      mapping_add_bytes (&mappings[j], mappings[j].start - mappings[j].end);
+
+   if (j != mapping_count && mappings[j].start < end) {
+      /* Cut off the start.  */
+      mapping_add_bytes (&mappings[j], mappings[j].start - end);
+      mappings[j].start = end;
+   }
+
+   memmove (&mappings[i], &mappings[j], (mapping_count - j) * sizeof (Mapping));
+   mapping_count -= j - i;
+}
+
+/* Add [start, end), replacing whatever was there.  */
+static void mapping_add (uintptr_t start, uintptr_t end, StackTrace * stack)
+{
+   mapping_remove (start, end);
+   if (stack == NULL || start == end || !mapping_reserve())
+      return;
+
+   size_t i = mapping_search (start);
+   memmove (&mappings[i + 1], &mappings[i],
+	    (mapping_count - i) * sizeof (Mapping));
+   ++mapping_count;
+   mappings[i].start = start;
+   mappings[i].end = end;
+   mappings[i].stack = stack;
+   mapping_add_bytes (&mappings[i], end - start);
+}
+
+/* Add the resident bytes of each mapping to its stack.  */
+static void mappings_measure (void)
+{
+   unsigned char pages [4096];
+   size_t page = page_size();
+
+   pthread_mutex_lock (&mapping_mutex);
+   for (size_t i = 0; i != mapping_count; ++i) {
+      const Mapping * m = &mappings[i];
+      size_t resident = 0;
+      for (uintptr_t start = m->start & -page; start < m->end;) {
+	 size_t n = (m->end - start + page - 1) / page;
+	 if (n > sizeof pages)
+	    n = sizeof pages;
+	 if (mincore ((void *) start, n * page, pages) == 0)
+	    for (size_t j = 0; j != n; ++j)
+	       resident += pages[j] & 1;
+	 start += n * page;
+      }
+      m->stack->resident += resident * page;
+   }
+   pthread_mutex_unlock (&mapping_mutex);
+}
+
+/* The stack for a new mapping, or NULL if it is not to be traced.  */
+static StackTrace * mapping_stack (void)
+{
+   enter();
+   StackTrace * it = depth == 1 ? get_StackTrace() : NULL;
+   leave();
+   return it;
+}
+
+void * mmap (void * address, size_t length, int prot, int flags, int fd,
+	     off_t offset)
+{
+   StackTrace * it = mapping_stack();
+   void * ret = sys_mmap (address, length, prot, flags, fd, offset);
+   if (ret == MAP_FAILED || it == NULL)
+      return ret;
+
+   size_t page = page_size();
+   pthread_mutex_lock (&mapping_mutex);
+   mapping_add ((uintptr_t) ret, ((uintptr_t) ret + length + page - 1) & -page,
+		it);
+   pthread_mutex_unlock (&mapping_mutex);
+   return ret;
+}
+
+#if __SIZEOF_LONG__ == 8
+ALIAS (mmap64, mmap);		/* The same, with 64-bit off_t.  */
+#endif
+
+int munmap (void * address, size_t length)
+{
+   size_t page = page_size();
+   pthread_mutex_lock (&mapping_mutex);
+   int ret = sys_munmap (address, length);
+   if (ret == 0)
+      mapping_remove ((uintptr_t) address,
+		      ((uintptr_t) address + length + page - 1) & -page);
+   pthread_mutex_unlock (&mapping_mutex);
+   return ret;
+}
+
+/* Like realloc, the new mapping belongs to the caller.  */
+void * mremap (void * old_address, size_t old_size, size_t new_size,
+	       int flags, ...)
+{
+   void * new_address = NULL;
+   if (flags & MREMAP_FIXED) {
+      va_list args;
+      va_start (args, flags);
+      new_address = va_arg (args, void *);
+      va_end (args);
+   }
+
+   StackTrace * it = mapping_stack();
+   size_t page = page_size();
+   pthread_mutex_lock (&mapping_mutex);
+   void * ret = sys_mremap (old_address, old_size, new_size, flags,
+			    new_address);
+   if (ret != MAP_FAILED) {
+#ifdef MREMAP_DONTUNMAP
+      if (!(flags & MREMAP_DONTUNMAP))
+#endif
+	 mapping_remove ((uintptr_t) old_address,
+			 ((uintptr_t) old_address + old_size + page - 1)
+			 & -page);
+      mapping_add ((uintptr_t) ret,
+		   ((uintptr_t) ret + new_size + page - 1) & -page, it);
+   }
+   pthread_mutex_unlock (&mapping_mutex);
+   return ret;
+}
+
+void * sbrk (intptr_t increment)
+{
+   StackTrace * it = increment > 0 ? mapping_stack() : NULL;
+   pthread_mutex_lock (&mapping_mutex);
+   char * ret = __sbrk (increment);
+   if (ret != (void *) -1) {
+      if (increment > 0)
+	 mapping_add ((uintptr_t) ret, (uintptr_t) (ret + increment), it);
+      else if (increment < 0)
+	 mapping_remove ((uintptr_t) (ret + increment), (uintptr_t) ret);
+   }
+   pthread_mutex_unlock (&mapping_mutex);
+   return ret;
+}
+
+int brk (void * address)
+{
+   StackTrace * it = mapping_stack();
+   pthread_mutex_lock (&mapping_mutex);
+   char * old = __sbrk (0);
+   intptr_t increment = (char *) address - old;
+   int ret = 0;
+   if (old == (void *) -1 || __sbrk (increment) == (void *) -1)
+      ret = -1;
+   else if (increment > 0)
+      mapping_add ((uintptr_t) old, (uintptr_t) address, it);
+   else if (increment < 0)
+      mapping_remove ((uintptr_t) address, (uintptr_t) old);
+   pthread_mutex_unlock (&mapping_mutex);
+   return ret;
+}
+
+
+/******************************************************************************
+ * Report data structures.
+ *
+ * Stacks that print the same are reported together; that happens whenever
+ * they differ only by addresses within the same functions.  Rather than
+ * format every stack and compare the strings, each symbolized frame gets an
+ * ID: the symbol if there is one, else the object, else the address (or the
+ * address anyway if we're printing offsets).  Each stack's tuple of frame IDs
+ * is then interned, one frame at a time, in a hash map keyed by the tuple
+ * without its last frame and that frame's ID.  Stacks with the same tuple share
+ * a row, and only the rows that get printed are ever formatted.
+ *****************************************************************************/
+
+/* A hash map from pairs of words to indexes.  Zero is not a valid index.  */
+typedef struct ReportMapEntry {
+   uintptr_t a;
+   uintptr_t b;
+   size_t    index;		/* Zero if the entry is empty.  */
+} ReportMapEntry;
+
+typedef struct ReportMap {
+   ReportMapEntry * table;
+   size_t           size;	/* A power of two.  */
+   size_t           count;
+} ReportMap;
+
+static inline size_t report_map_slot (const ReportMap * map,
+				      uintptr_t a, uintptr_t b)
+{
+   uint64_t hash = (a * 0x9E3779B97F4A7C15ULL) ^ (b * 0xC2B2AE3D27D4EB4FULL);
+   return (hash ^ (hash >> 29)) & (map->size - 1);
+}
+
+/* Find a pair's index, or zero.  */
+static size_t report_map_find (const ReportMap * map, uintptr_t a, uintptr_t b)
+{
+   if (map->size == 0)
+      return 0;
+
+   for (size_t i = report_map_slot (map, a, b);; i = (i + 1) & (map->size - 1)) {
+      const ReportMapEntry * e = &map->table[i];
+      if (e->index == 0)
+	 return 0;
+      if (e->a == a && e->b == b)
+	 return e->index;
+   }
+}
+
+/* Find a pair's index, or add it with the given one.  Returns zero if out of
+ * memory.  */
+static size_t report_map_intern (ReportMap * map, uintptr_t a, uintptr_t b,
+				 size_t index)
+{
+   if ((map->count + 1) * 2 > map->size) {
+      ReportMap bigger = { NULL, map->size ? map->size * 2 : 1024, map->count };
+      bigger.table = real.calloc (bigger.size, sizeof (ReportMapEntry));
+      if (bigger.table == NULL)
+	 return 0;
+      for (size_t i = 0; i != map->size; ++i) {
+	 const ReportMapEntry * e = &map->table[i];
+	 if (e->index == 0)
+	    continue;
+	 size_t j = report_map_slot (&bigger, e->a, e->b);
+	 while (bigger.table[j].index != 0)
+	    j = (j + 1) & (bigger.size - 1);
+	 bigger.table[j] = *e;
+      }
+      real.free (map->table);
+      *map = bigger;
+   }
+
+   size_t i = report_map_slot (map, a, b);
+   for (; map->table[i].index != 0; i = (i + 1) & (map->size - 1))
+      if (map->table[i].a == a && map->table[i].b == b)
+	 return map->table[i].index;
+
+   map->table[i].a = a;
+   map->table[i].b = b;
+   map->table[i].index = index;
+   ++map->count;
+   return index;
+}
+
+/* Grow an array to hold at least count + 1 items.  */
+static void * report_grow (void * array, size_t * capacity, size_t count,
+			   size_t size)
+{
+   if (count < *capacity)
+      return array;
+
+   size_t bigger = *capacity ? *capacity * 2 : 1024;
+   array = real.realloc (array, bigger * size);
+   if (array != NULL)
+      *capacity = bigger;
+   return array;
+}
+
+/* A row of the report: the stacks with one tuple.  */
+typedef struct ReportItem {
+   size_t       tuple;
+   ssize_t      bytes;		/* Since the last report.  */
+   ssize_t      current;	/* Outstanding now.  */
+   ssize_t      peak;		/* Outstanding at the peak.  */
+   Churn        churn;
+   size_t       short_lived;
+   Sizes        sizes;
+   size_t       allocs;		/* Sum of the size classes.  */
+   ssize_t      mapped;
+   size_t       resident;
+} ReportItem;
+
+/* A trie node in the report, and the tuple of the stack ending there.  */
+typedef struct ReportFrame {
+   const Frame * frame;
+   size_t        tuple;
+} ReportFrame;
+
+/* Frees by one tuple of another's allocations, on another thread.  */
+typedef struct ReportPair {
+   size_t allocator;		/* Tuples.  */
+   size_t freer;
+   size_t frees;
+} ReportPair;
+
+typedef struct ReportTuple {
+   size_t parent;		/* The tuple without the last frame.  */
+   size_t frame;		/* A ReportFrame for the last frame.  */
+   size_t row;			/* The row for this tuple, or zero.  */
+} ReportTuple;
+
+/* Everything in one report.  The frame, tuple and row arrays are indexed from
+ * one, and tuple zero is the empty stack.  */
+typedef struct Report {
+   StackTrace **          stacks;
+   size_t                 stack_count, stacks_size;
+   ReportFrame *          frames;
+   size_t                 frame_count, frames_size;
+   reflect_symtab_result * results;	/* For each frame.  */
+   ReportTuple *          tuples;
+   size_t                 tuple_count, tuples_size;
+   ReportItem *           rows;
+   size_t                 row_count;
+   ReportMap              frame_map;	/* Frame * -> frame.  */
+   ReportMap              tuple_map;	/* (tuple, frame ID) -> tuple.  */
+   ReportPair *           pairs;
+   size_t                 pair_count, pairs_size;
+   ReportMap              pair_map;	/* (tuple, tuple) -> pair.  */
+} Report;
+
+static int compare_by_bytes (const void * a, const void * b)
+{
+   const ReportItem * aa = a;
+   const ReportItem * bb = b;
+   if (aa->bytes == bb->bytes)
+      return 0;
+
+   return aa->bytes > bb->bytes ? -1 : 1;
+}
+
+static int compare_by_peak (const void * a, const void * b)
+{
+   const ReportItem * aa = a;
+   const ReportItem * bb = b;
+   if (aa->peak == bb->peak)
+      return 0;
+
+   return aa->peak > bb->peak ? -1 : 1;
+}
+
+static int compare_by_short_lived (const void * a, const void * b)
+{
+   const ReportItem * aa = a;
+   const ReportItem * bb = b;
+   if (aa->short_lived == bb->short_lived)
+      return 0;
+
+   return aa->short_lived > bb->short_lived ? -1 : 1;
+}
+
+static int compare_by_frees (const void * a, const void * b)
+{
+   const ReportPair * aa = a;
+   const ReportPair * bb = b;
+   if (aa->frees == bb->frees)
+      return 0;
+
+   return aa->frees > bb->frees ? -1 : 1;
+}
 
-   return aa->bytes > bb->bytes ? -1 : 1;
+static int compare_by_allocs (const void * a, const void * b)
+{
+   const ReportItem * aa = a;
+   const ReportItem * bb = b;
+   if (aa->allocs == bb->allocs)
+      return 0;
+
+   return aa->allocs > bb->allocs ? -1 : 1;
+}
+
+static int compare_by_mapped (const void * a, const void * b)
+{
+   const ReportItem * aa = a;
+   const ReportItem * bb = b;
+   if (aa->mapped == bb->mapped)
+      return 0;
+
+   return aa->mapped > bb->mapped ? -1 : 1;
+}
+
+/* Has anything happened on a stack since the last report, or is it part of
+ * the current or peak heap?  */
+static inline int stack_changed (StackTrace * it)
+{
+   return stack_report_bytes (it) != 0
+      || it->reported != 0
+      || stack_peak_bytes (it) != 0
+      || __atomic_load_n (&it->mapped, __ATOMIC_RELAXED) != 0
+      || __atomic_load_n (&it->churn.allocs, __ATOMIC_RELAXED) != 0
+      || __atomic_load_n (&it->churn.frees, __ATOMIC_RELAXED) != 0
+      || __atomic_load_n (&it->churn.foreign_frees, __ATOMIC_RELAXED) != 0;
+}
+
+/* Take a stack's counts, resetting them.  */
+#define TAKE(count) __atomic_exchange_n (&(count), 0, __ATOMIC_RELAXED)
+
+static void take_churn (Churn * from, Churn * to)
+{
+   to->allocs = TAKE (from->allocs);
+   to->frees = TAKE (from->frees);
+   to->bytes = TAKE (from->bytes);
+   to->remote_frees = TAKE (from->remote_frees);
+   to->foreign_frees = TAKE (from->foreign_frees);
+   for (int i = 0; i != LIFETIME_BUCKETS; ++i)
+      to->lifetimes[i] = TAKE (from->lifetimes[i]);
+}
+
+static void take_sizes (Sizes * from, Sizes * to)
+{
+   for (int i = 0; i != SIZE_CLASSES; ++i)
+      to->classes[i] = TAKE (from->classes[i]);
+   to->common = TAKE (from->common);
+   to->votes = TAKE (from->votes);
+   to->hits = TAKE (from->hits);
+}
+
+static void add_churn (Churn * to, const Churn * from)
+{
+   to->allocs += from->allocs;
+   to->frees += from->frees;
+   to->bytes += from->bytes;
+   to->remote_frees += from->remote_frees;
+   to->foreign_frees += from->foreign_frees;
+   for (int i = 0; i != LIFETIME_BUCKETS; ++i)
+      to->lifetimes[i] += from->lifetimes[i];
+}
+
+/* Add up sizes.  The common size is whichever had more hits.  */
+static void add_sizes (Sizes * to, const Sizes * from)
+{
+   for (int i = 0; i != SIZE_CLASSES; ++i)
+      to->classes[i] += from->classes[i];
+
+   if (to->hits == 0 || to->common == from->common) {
+      to->common = from->common;
+      to->hits += from->hits;
+   }
+   else if (from->hits > to->hits) {
+      to->common = from->common;
+      to->hits = from->hits;
+   }
 }
 
+/* When we started, and when the last report was, for rates.  */
+static uint64_t start_time;
+static uint64_t last_report_time;
+
 /* Should we keep the offsets into functions? */
 int report_offsets = 0;
 
+/* Find the stacks to report, and the trie nodes on their paths.  */
+static int report_collect (Report * r)
+{
+   for (StackTrace ** bucket = stack_hash;
+	bucket != stack_hash + STACK_HASH_SIZE; ++bucket)
+      for (StackTrace * it = __atomic_load_n (bucket, __ATOMIC_ACQUIRE);
+	   it; it = it->next) {
+         if (!stack_changed (it))
+            continue;           /* Ignore this one. */
+
+	 void * p = report_grow (r->stacks, &r->stacks_size, r->stack_count,
+				 sizeof (StackTrace *));
+	 if (p == NULL)
+	    return 0;
+	 r->stacks = p;
+	 r->stacks[r->stack_count++] = it;
+
+	 /* Add its frames, until we get to ones already added.  */
+	 for (const Frame * f = it->leaf; f; f = f->parent) {
+	    size_t index = report_map_intern (&r->frame_map, (uintptr_t) f, 0,
+					      r->frame_count + 1);
+	    if (index == 0)
+	       return 0;
+	    if (index != r->frame_count + 1)
+	       break;
+
+	    p = report_grow (r->frames, &r->frames_size, r->frame_count + 1,
+			     sizeof (ReportFrame));
+	    if (p == NULL)
+	       return 0;
+	    r->frames = p;
+	    r->frames[++r->frame_count].frame = f;
+	 }
+      }
+
+   return 1;
+}
+
+/* Symbolize the frames, and work out each one's tuple.  */
+static int report_symbolize (Report * r)
+{
+   size_t n = r->frame_count + 1;
+   const void ** addresses = real.malloc (n * sizeof (void *));
+   r->results = real.malloc (n * sizeof (reflect_symtab_result));
+   /* Frames ordered by depth, so each one's parent comes first.  */
+   size_t * order = real.malloc (n * sizeof (size_t));
+   size_t * starts = real.calloc (MAX_STACK_SIZE + 2, sizeof (size_t));
+   r->tuples = real.malloc (sizeof (ReportTuple));
+   r->tuples_size = 1;
+   if (addresses == NULL || r->results == NULL || order == NULL
+       || starts == NULL || r->tuples == NULL) {
+      real.free (addresses);
+      real.free (order);
+      real.free (starts);
+      return 0;
+   }
+
+   addresses[0] = NULL;
+   for (size_t i = 1; i != n; ++i)
+      addresses[i] = r->frames[i].frame->address;
+   reflect_symtab_lookup_batch (addresses + 1, n - 1, r->results + 1);
+   real.free (addresses);
+
+   for (size_t i = 1; i != n; ++i)
+      ++starts[r->frames[i].frame->depth + 1];
+   for (int d = 1; d != MAX_STACK_SIZE + 2; ++d)
+      starts[d] += starts[d - 1];
+   for (size_t i = 1; i != n; ++i)
+      order[starts[r->frames[i].frame->depth]++] = i;
+   real.free (starts);
+
+   /* The empty tuple.  */
+   r->tuples[0].parent = 0;
+   r->tuples[0].frame = 0;
+   r->tuples[0].row = 0;
+
+   int ok = 1;
+   for (size_t o = 0; o != n - 1 && ok; ++o) {
+      size_t i = order[o];
+      const Frame * f = r->frames[i].frame;
+      const reflect_symtab_result * result = &r->results[i];
+
+      size_t parent = 0;
+      if (f->parent != NULL)
+	 parent = r->frames[report_map_find (&r->frame_map,
+					     (uintptr_t) f->parent, 0)].tuple;
+
+      uintptr_t id = (uintptr_t) f->address;
+      if (!report_offsets && result->symbol != NULL)
+	 id = (uintptr_t) result->symbol;
+      else if (!report_offsets && result->object != NULL)
+	 id = (uintptr_t) result->object;
+
+      size_t tuple = report_map_intern (&r->tuple_map, parent, id,
+					r->tuple_count + 1);
+      if (tuple == r->tuple_count + 1) {
+	 void * p = report_grow (r->tuples, &r->tuples_size, tuple,
+				 sizeof (ReportTuple));
+	 if (p == NULL)
+	    ok = 0;
+	 else {
+	    r->tuples = p;
+	    r->tuples[tuple].parent = parent;
+	    r->tuples[tuple].frame = i;
+	    r->tuples[tuple].row = 0;
+	    ++r->tuple_count;
+	 }
+      }
+      else if (tuple == 0)
+	 ok = 0;
+      r->frames[i].tuple = tuple;
+   }
+
+   real.free (order);
+   return ok;
+}
+
+/* Take the counts from each stack, and add them up by tuple.  */
+static int report_aggregate (Report * r, ssize_t * outstanding,
+			     ssize_t * total)
+{
+   r->rows = real.malloc ((r->stack_count + 1) * sizeof (ReportItem));
+   if (r->rows == NULL)
+      return 0;
+
+   *outstanding = 0;
+   *total = 0;
+   for (size_t s = 0; s != r->stack_count; ++s) {
+      StackTrace * it = r->stacks[s];
+      size_t tuple = 0;
+      if (it->leaf != NULL)
+	 tuple = r->frames[report_map_find (&r->frame_map,
+					    (uintptr_t) it->leaf, 0)].tuple;
+
+      ReportItem * row;
+      if (r->tuples[tuple].row == 0) {
+	 r->tuples[tuple].row = ++r->row_count;
+	 row = &r->rows[r->row_count];
+	 memset (row, 0, sizeof (ReportItem));
+	 row->tuple = tuple;
+      }
+      else
+	 row = &r->rows[r->tuples[tuple].row];
+
+      /* Take the change in bytes since the last report.  */
+      ssize_t current = stack_report_bytes (it);
+      ssize_t bytes = current - it->reported;
+      it->reported = current;
+      *outstanding += current;
+      *total += bytes;
+
+      Churn churn;
+      take_churn (&it->churn, &churn);
+      Sizes sizes;
+      take_sizes (&it->sizes, &sizes);
+      row->bytes += bytes;
+      row->current += current;
+      row->peak += stack_peak_bytes (it);
+      add_churn (&row->churn, &churn);
+      add_sizes (&row->sizes, &sizes);
+      row->mapped += __atomic_load_n (&it->mapped, __ATOMIC_RELAXED);
+      row->resident += it->resident;
+      it->resident = 0;
+   }
+
+   for (size_t i = 1; i <= r->row_count; ++i) {
+      ReportItem * p = &r->rows[i];
+      p->short_lived = 0;
+      for (int b = 0; b != SHORT_LIVED; ++b)
+         p->short_lived += p->churn.lifetimes[b];
+      p->allocs = 0;
+      for (int c = 0; c != SIZE_CLASSES; ++c)
+         p->allocs += p->sizes.classes[c];
+   }
+
+   return 1;
+}
+
+/* The tuple of a stack, or -1 if it is not in the report.  */
+static ssize_t report_stack_tuple (const Report * r, const StackTrace * it)
+{
+   if (it->leaf == NULL)
+      return 0;
+
+   size_t frame = report_map_find (&r->frame_map, (uintptr_t) it->leaf, 0);
+   return frame ? (ssize_t) r->frames[frame].tuple : -1;
+}
+
+/* Take the cross-thread frees, and add them up by pairs of tuples.  Pairs with
+ * stacks not in the report are left for the next.  */
+static int report_pairs (Report * r)
+{
+   for (size_t i = 0; i != CROSS_PAIRS; ++i) {
+      CrossPair * pair = &cross_pairs[i];
+      uint64_t key = __atomic_load_n (&pair->key, __ATOMIC_RELAXED);
+      if (key == 0)
+	 continue;
+
+      /* Idle since the last report: let another pair have the slot.  A free
+       * racing with this may go to the wrong pair, or to the pair again in a
+       * second slot, which reports add up.  */
+      if (__atomic_load_n (&pair->frees, __ATOMIC_RELAXED) == 0) {
+	 __atomic_compare_exchange_n (&pair->key, &key, 0, 0,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	 continue;
+      }
+
+      --key;
+      ssize_t allocator = report_stack_tuple (
+	 r, stack_at (key >> STACK_INDEX_BITS));
+      ssize_t freer = report_stack_tuple (
+	 r, stack_at (key & ((1 << STACK_INDEX_BITS) - 1)));
+      if (allocator < 0 || freer < 0)
+	 continue;
+
+      size_t index = report_map_intern (&r->pair_map, allocator, freer,
+					r->pair_count + 1);
+      if (index == 0)
+	 return 0;
+      if (index == r->pair_count + 1) {
+	 void * p = report_grow (r->pairs, &r->pairs_size, r->pair_count,
+				 sizeof (ReportPair));
+	 if (p == NULL)
+	    return 0;
+	 r->pairs = p;
+	 r->pairs[r->pair_count].allocator = allocator;
+	 r->pairs[r->pair_count].freer = freer;
+	 r->pairs[r->pair_count].frees = 0;
+	 ++r->pair_count;
+      }
+      r->pairs[index - 1].frees
+	 += __atomic_exchange_n (&pair->frees, 0, __ATOMIC_RELAXED);
+   }
+
+   return 1;
+}
+
+/* Print a row's most common size classes, enough to cover 90% of its
+ * allocations, and its most common size if that is over 90% of them.  */
+static void report_print_sizes (FILE * f, const ReportItem * p)
+{
+   fprintf (f, "%zu allocs", p->allocs);
+   if ((size_t) p->sizes.hits * 10 > p->allocs * 9)
+      fprintf (f, ", %.0f%% of %zu bytes", p->sizes.hits * 1e2 / p->allocs,
+	       p->sizes.common);
+   fputs ("\nsizes", f);
+
+   int done [SIZE_CLASSES] = { 0 };
+   size_t covered = 0;
+   for (int n = 0; n != 3 && covered * 10 < p->allocs * 9; ++n) {
+      int best = -1;
+      for (int c = 0; c != SIZE_CLASSES; ++c)
+	 if (!done[c] && p->sizes.classes[c] != 0
+	     && (best < 0 || p->sizes.classes[c] > p->sizes.classes[best]))
+	    best = c;
+      if (best < 0)
+	 break;
+
+      done[best] = 1;
+      covered += p->sizes.classes[best];
+      if (best == 0)
+	 fputs (" 0", f);
+      else if (best == SIZE_CLASSES - 1)
+	 fprintf (f, " %zu+", size_class_max (best - 1) + 1);
+      else
+	 fprintf (f, " %zu-%zu", size_class_max (best - 1) + 1,
+		  size_class_max (best));
+      fprintf (f, ":%.0f%%", p->sizes.classes[best] * 1e2 / p->allocs);
+   }
+   fputc ('\n', f);
+}
+
+/* Print a row's stack, innermost frame first.  */
+static void report_print_stack (FILE * f, const Report * r, size_t tuple)
+{
+   size_t frames [MAX_STACK_SIZE];
+   size_t n = 0;
+   for (; tuple != 0 && n != MAX_STACK_SIZE; tuple = r->tuples[tuple].parent)
+      frames[n++] = r->tuples[tuple].frame;
+   while (n != 0)
+      reflect_symtab_print (f, &r->results[frames[--n]], report_offsets);
+}
+
+static void report_free (Report * r)
+{
+   real.free (r->stacks);
+   real.free (r->frames);
+   real.free (r->results);
+   real.free (r->tuples);
+   real.free (r->rows);
+   real.free (r->frame_map.table);
+   real.free (r->tuple_map.table);
+   real.free (r->pairs);
+   real.free (r->pair_map.table);
+}
+
 /******************************************************************************
  * print_report
  *
@@ -410,97 +2479,45 @@ void print_report (void)
    if (depth != 1)
       return;
 
+   /* Other threads carry on allocating while we report, but only one report
+    * is generated at a time.  */
+   pthread_mutex_lock (&report_mutex);
+
+   /* Take the snapshot.  From here on, each stack saves its bytes before it
+    * next changes, so we see them as they are now however long we take.  */
+   __atomic_add_fetch (&report_epoch, 1, __ATOMIC_RELEASE);
+   uint64_t report_time = now();
+   if (report_resident)
+      mappings_measure();
+
    /* Do this before we start doing stuff with the hash tables, just in case
     * allocations within the symbol table stuff ends up modifying them.
     * (mallocs there are fine, because they won't be recorded, but reallocs and
-    * frees are more problematic.  */
+    * frees are more problematic.  The symbol table persists between reports,
+    * so this only picks up objects loaded or unloaded since the last one.  */
    reflect_symtab_create();
 
-   /* Count the number of changed entries in the hash table.  */
-   size_t stack_hash_live = 0;
-   for (StackTrace ** bucket = stack_hash;
-	bucket != stack_hash + STACK_HASH_SIZE; ++bucket) {
-      /* Iterate over this hash chain.  */
-      for (StackTrace * it = *bucket; it; it = it->next)
-         if (it->bytes)
-            ++stack_hash_live;
-   }
-
-   ReportItem * report_array
-      = __libc_malloc (stack_hash_live * sizeof (ReportItem));
-   if (report_array == NULL) {
+   Report r;
+   memset (&r, 0, sizeof r);
+   ssize_t outstanding, total;
+   if (!report_collect (&r) || !report_symbolize (&r)
+       || !report_aggregate (&r, &outstanding, &total)
+       || !report_pairs (&r)) {
       /* We don't use fprintf(stderr) here as we may conceivably be called from
        * within such a printf!  */
       write (1, "mtrace: cannot report (Out of memory).\n", 39);
-      need_report = 0;
-      return;
-   }
-
-   ReportItem * report_array_end = report_array;
-
-   /*** Iterate over the hash table.  ***/
-   size_t total = 0;
-   for (StackTrace ** bucket = stack_hash;
-	bucket != stack_hash + STACK_HASH_SIZE; ++bucket) {
-      /* Iterate over this hash chain. */
-      StackTrace * next;
-      for (StackTrace * it = *bucket; it; it = next) {
-	 next = it->next;
-
-         if (it->bytes == 0)
-            continue;           /* Ignore this one. */
-
-         /* Create report entry.  In theory this could corrupt our data
-	    structures by freeing memory and changing stuff underneath us, but
-	    in reality all the MM here should occur at depth > 1 and be
-	    ignored.  */
-         const char * string = reflect_symtab_format (it->stack,
-						      STACK_SIZE,
-						      report_offsets);
-         if (string == NULL)
-            continue;           // OOM.
-
-         total += it->bytes;
-         report_array_end->string = string;
-         report_array_end->bytes = it->bytes;
-         ++report_array_end;
-
-         /* Reset the stack record.  */
-         it->bytes = 0;
-
-         if (it->refs == 0)
-	    free_StackTrace (it); /* This item is dead; remove it.  */
-      }
+      goto cleanup;
    }
 
-   reflect_symtab_destroy();
-
-   if (report_array != report_array_end) {
-      /* Sort the array by string.  */
-      qsort (report_array,
-             report_array_end - report_array,
-             sizeof (ReportItem),
-             compare_by_string);
-
-      /* Collapse items with identical strings.  */
-      ReportItem * p = report_array;
-      for (ReportItem * q = report_array + 1; q != report_array_end; ++q) {
-         if (strcmp (p->string, q->string) == 0) {
-            /* Collapse.  */
-            p->bytes += q->bytes;
-            free ((void *) q->string);
-         }
-         else
-            /* No collapse; advance p.  */
-            *++p = *q;
-      }
+   ReportItem * report_array = r.rows + 1;
+   ReportItem * report_array_end = report_array + r.row_count;
 
-      report_array_end = p + 1;
+   /*** Sort by number of bytes.  ***/
+   qsort (report_array, report_array_end - report_array,
+          sizeof (ReportItem), compare_by_bytes);
 
-      /*** Now sort by number of bytes.  ***/
-      qsort (report_array, report_array_end - report_array,
-             sizeof (ReportItem), compare_by_bytes);
-   }
+   double seconds = (report_time - last_report_time) * 1e-9;
+   last_report_time = report_time;
 
    /*** Print the report.  ***/
    char * file_name;
@@ -514,40 +2531,546 @@ void print_report (void)
    if (output_file == NULL)
       goto cleanup;
 
-   fprintf (output_file, "Outanding bytes: %zi (%+zi)\n", global_bytes, total);
+   fprintf (output_file, "Outanding bytes: %zi (%+zi)", outstanding, total);
+   if (sample_interval > 0)
+      fprintf (output_file, " sampled every %zi bytes", sample_interval);
+   fputc ('\n', output_file);
    for (ReportItem * p = report_array; p != report_array_end; ++p) {
       /* There may be some items with 0 bytes, due to collapsing items with
-	 identical strings.  Make sure we skip these.  */
+	 identical stacks.  Make sure we skip these.  */
       if (p->bytes != 0) {
          fprintf (output_file, "%+zi\n", p->bytes);
-         fputs (p->string, output_file);
+         report_print_stack (output_file, &r, p->tuple);
       }
    }
 
+   /*** Then what made up the peak, largest first.  ***/
+   qsort (report_array, report_array_end - report_array,
+          sizeof (ReportItem), compare_by_peak);
+
+   fprintf (output_file, "\nPeak bytes: %zi at %.3fs\n", peak_bytes,
+	    peak_time ? (peak_time - start_time) * 1e-9 : 0.0);
+   for (ReportItem * p = report_array; p != report_array_end; ++p) {
+      if (p->peak <= 0)
+	 break;
+
+      fprintf (output_file, "%zi (now %zi)\n", p->peak, p->current);
+      report_print_stack (output_file, &r, p->tuple);
+   }
+
+   /*** Then the churn: short-lived allocations, most frequent first.  ***/
+   qsort (report_array, report_array_end - report_array,
+          sizeof (ReportItem), compare_by_short_lived);
+
+   fprintf (output_file,
+	    "\nShort-lived allocations (freed within %luus) over %.3fs:\n",
+	    1UL << (SHORT_LIVED - 1), seconds);
+   for (ReportItem * p = report_array; p != report_array_end; ++p) {
+      if (p->short_lived == 0)
+	 break;
+
+      fprintf (output_file, "%.1f/s allocs %zu frees %zu bytes %zu\n",
+	       p->short_lived / seconds, p->churn.allocs, p->churn.frees,
+	       p->churn.bytes);
+      fputs ("lifetimes", output_file);
+      for (int i = 0; i != LIFETIME_BUCKETS; ++i)
+	 if (p->churn.lifetimes[i] != 0)
+	    fprintf (output_file, " <%luus:%u", 1UL << i, p->churn.lifetimes[i]);
+      fputc ('\n', output_file);
+      report_print_stack (output_file, &r, p->tuple);
+   }
+
+   /*** Then the cross-thread frees, busiest pairs of stacks first.  ***/
+   size_t frees = 0;
+   size_t cross_frees = 0;
+   for (ReportItem * p = report_array; p != report_array_end; ++p) {
+      frees += p->churn.frees;
+      cross_frees += p->churn.remote_frees;
+   }
+   qsort (r.pairs, r.pair_count, sizeof (ReportPair), compare_by_frees);
+
+   fprintf (output_file,
+	    "\nCross-thread frees over %.3fs: %zu of %zu frees\n",
+	    seconds, cross_frees, frees);
+   for (size_t i = 0; i != r.pair_count; ++i) {
+      fprintf (output_file, "%zu allocated by\n", r.pairs[i].frees);
+      report_print_stack (output_file, &r, r.pairs[i].allocator);
+      fputs ("freed by\n", output_file);
+      report_print_stack (output_file, &r, r.pairs[i].freer);
+   }
+
+   /*** Then the sizes allocated, by the most allocations.  ***/
+   qsort (report_array, report_array_end - report_array,
+          sizeof (ReportItem), compare_by_allocs);
+
+   fprintf (output_file, "\nAllocation sizes over %.3fs:\n", seconds);
+   for (ReportItem * p = report_array; p != report_array_end; ++p) {
+      if (p->allocs == 0)
+	 break;
+
+      report_print_sizes (output_file, p);
+      report_print_stack (output_file, &r, p->tuple);
+   }
+
+   /*** Then the mappings, largest first, if there are any.  ***/
+   qsort (report_array, report_array_end - report_array,
+          sizeof (ReportItem), compare_by_mapped);
+
+   ssize_t mapped = 0;
+   size_t resident = 0;
+   for (ReportItem * p = report_array; p != report_array_end; ++p) {
+      mapped += p->mapped;
+      resident += p->resident;
+   }
+
+   if (mapped != 0) {
+      fprintf (output_file, "\nMapped bytes: %zi", mapped);
+      if (report_resident)
+	 fprintf (output_file, " (resident %zu)", resident);
+      fputc ('\n', output_file);
+   }
+   for (ReportItem * p = report_array; p != report_array_end; ++p) {
+      if (p->mapped <= 0)
+	 break;
+
+      fprintf (output_file, "%zi", p->mapped);
+      if (report_resident)
+	 fprintf (output_file, " (resident %zu)", p->resident);
+      fputc ('\n', output_file);
+      report_print_stack (output_file, &r, p->tuple);
+   }
+
    fclose (output_file);
 
  cleanup:
    /* Free all the memory.  */
-   for (ReportItem * p = report_array; p != report_array_end; ++p)
-      __libc_free ((void *) p->string);
+   report_free (&r);
 
-   __libc_free (report_array);
-
-   need_report = 0;
+   pthread_mutex_unlock (&report_mutex);
 
    return;
 }
 
+/******************************************************************************
+ * The reporter thread.
+ *
+ * SIGUSR1 wakes a thread of our own to write the report, so that no thread of
+ * the program stops to do it: they only save a stack's bytes when they first
+ * change it after the snapshot.  Without threads, if the thread cannot be
+ * started, or in a child after fork, the next thread into the memory tracing
+ * code writes the report instead.
+ *****************************************************************************/
+#if THREADS
+static sem_t report_request;
+static int   reporter_running;
+
+/* Start a thread of our own.  It takes no signals, so they go to the
+ * program, and what pthread_create allocates for it isn't traced.  */
+static int start_thread (void * (* function) (void *), void * arg)
+{
+   ++depth;
+   sigset_t all, old;
+   sigfillset (&all);
+   pthread_sigmask (SIG_SETMASK, &all, &old);
+   pthread_t thread;
+   pthread_attr_t attr;
+   pthread_attr_init (&attr);
+   pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+   int ret = pthread_create (&thread, &attr, function, arg);
+   pthread_attr_destroy (&attr);
+   pthread_sigmask (SIG_SETMASK, &old, NULL);
+   --depth;
+   return ret == 0;
+}
+
+static void * reporter_thread (void * unused)
+{
+   /* Nothing we do here should be traced.  */
+   ++depth;
+
+   for (;;) {
+      while (sem_wait (&report_request) != 0)
+	 ;
+      print_report();
+   }
+   return NULL;
+}
+
+/* The thread isn't copied by fork.  */
+static void reporter_forked (void)
+{
+   reporter_running = 0;
+}
+
+static void reporter_start (void)
+{
+   if (sem_init (&report_request, 0, 0) != 0)
+      return;
+
+   reporter_running = start_thread (reporter_thread, NULL);
+   pthread_atfork (NULL, NULL, reporter_forked);
+}
+
+/* Ask for a report.  This is called from the signal handler, so must be
+ * async-signal-safe, as sem_post is.  */
+static void request_report (void)
+{
+   if (reporter_running)
+      sem_post (&report_request);
+   else
+      need_report = 1;
+}
+#else
+static void reporter_start (void) { }
+static void request_report (void) { need_report = 1; }
+#endif
+
+/******************************************************************************
+ * Timeline
+ *
+ * With MTRACE_TIMELINE=file, a background thread appends to a binary log,
+ * every MTRACE_TIMELINE_INTERVAL milliseconds (default 1000), the change in
+ * bytes of each stack that changed.  The heap's growth over time can then be
+ * reconstructed offline, without stopping the program.
+ *
+ * The file starts with the 8 bytes "MTRACETL", then a sequence of records.
+ * Each is a type byte and then fields, all numbers being LEB128: unsigned, or
+ * signed for deltas.
+ *
+ *  'M'  Module list, replacing any earlier one: count, then for each module
+ *       its load bias, start and end address, name length and name.
+ *  'S'  Stack definition: index, frame count, then each frame address as the
+ *       (signed) difference from the previous one (the first from zero).
+ *  'T'  Tick: nanoseconds since the last tick (the first since start),
+ *       count, then for each stack that changed its index as the difference
+ *       from the previous one (the first from zero), and its (signed) change
+ *       in bytes.
+ *
+ * Stacks are defined before their first tick.  The file is written through a
+ * mapping, and grows in steps, so a zero type byte marks the end of the data
+ * so far.  The steps are allocated before they are mapped, as storing to a
+ * page the filesystem has no room for would kill the program.  If the file
+ * cannot grow, the timeline stops, and the file is cut after the last whole
+ * tick.
+ *****************************************************************************/
+#if THREADS
+typedef struct Timeline {
+   int             fd;
+   unsigned char * map;
+   size_t          size;
+   size_t          used;
+   size_t          ticked;	/* Bytes up to the end of the last tick.  */
+   int             full;	/* Has the file failed to grow?  */
+   uint64_t        last_tick;
+   unsigned long long loads;	/* Object loads and unloads last seen.  */
+   pthread_mutex_t lock;
+} Timeline;
+
+static Timeline timeline = { -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Make room for n more bytes.  Once that fails, nothing more is written.  */
+static int timeline_reserve (size_t n)
+{
+   if (timeline.used + n <= timeline.size)
+      return 1;
+   if (timeline.full)
+      return 0;
+
+   size_t size = timeline.size ? timeline.size : 1 << 20;
+   while (size < timeline.used + n)
+      size *= 2;
+
+   /* A sparse file would grow even with the disk full.  */
+   void * map = MAP_FAILED;
+   if (posix_fallocate (timeline.fd, timeline.size, size - timeline.size) == 0)
+      map = sys_mremap (timeline.map, timeline.size, size, MREMAP_MAYMOVE,
+			NULL);
+   if (map == MAP_FAILED) {
+      timeline.full = 1;
+      return 0;
+   }
+   timeline.map = map;
+   timeline.size = size;
+   return 1;
+}
+
+static void timeline_byte (unsigned char byte)
+{
+   if (timeline_reserve (1))
+      timeline.map[timeline.used++] = byte;
+}
+
+static void timeline_uleb (uint64_t n)
+{
+   do {
+      unsigned char byte = n & 0x7f;
+      n >>= 7;
+      timeline_byte (n ? byte | 0x80 : byte);
+   }
+   while (n);
+}
+
+static void timeline_sleb (int64_t n)
+{
+   for (;;) {
+      unsigned char byte = n & 0x7f;
+      n >>= 7;
+      if ((n == 0 && !(byte & 0x40)) || (n == -1 && (byte & 0x40))) {
+	 timeline_byte (byte);
+	 return;
+      }
+      timeline_byte (byte | 0x80);
+   }
+}
+
+static int timeline_module_1 (struct dl_phdr_info * info, size_t size,
+			      void * data)
+{
+   uintptr_t start = UINTPTR_MAX;
+   uintptr_t end = 0;
+   for (int i = 0; i < info->dlpi_phnum; ++i) {
+      const ElfW(Phdr) * header = &info->dlpi_phdr[i];
+      if (header->p_type != PT_LOAD)
+	 continue;
+      uintptr_t address = info->dlpi_addr + header->p_vaddr;
+      if (address < start)
+	 start = address;
+      if (address + header->p_memsz > end)
+	 end = address + header->p_memsz;
+   }
+
+   if (data != NULL) {
+      /* Just counting.  */
+      ++*(size_t *) data;
+      return 0;
+   }
+
+   const char * name = info->dlpi_name ? info->dlpi_name : "";
+   size_t length = strlen (name);
+   timeline_uleb (info->dlpi_addr);
+   timeline_uleb (end > start ? start : 0);
+   timeline_uleb (end > start ? end : 0);
+   timeline_uleb (length);
+   if (timeline_reserve (length)) {
+      memcpy (timeline.map + timeline.used, name, length);
+      timeline.used += length;
+   }
+   return 0;
+}
+
+static int timeline_loads_1 (struct dl_phdr_info * info, size_t size,
+			     void * data)
+{
+   if (size >= offsetof (struct dl_phdr_info, dlpi_subs)
+       + sizeof (info->dlpi_subs))
+      *(unsigned long long *) data = info->dlpi_adds + info->dlpi_subs;
+   return 1;
+}
+
+/* Write the module list, if it has changed.  */
+static void timeline_modules (void)
+{
+   unsigned long long loads = 0;
+   dl_iterate_phdr (timeline_loads_1, &loads);
+   if (loads == timeline.loads && timeline.loads != 0)
+      return;
+   timeline.loads = loads;
+
+   size_t count = 0;
+   dl_iterate_phdr (timeline_module_1, &count);
+   timeline_byte ('M');
+   timeline_uleb (count);
+   dl_iterate_phdr (timeline_module_1, NULL);
+}
+
+/* Get the frames of a stack, innermost first.  Returns how many.  */
+static size_t stack_frames (const StackTrace * it,
+			    const void * frames [MAX_STACK_SIZE])
+{
+   size_t depth = it->leaf ? it->leaf->depth : 0;
+   for (const Frame * f = it->leaf; f; f = f->parent)
+      frames[f->depth - 1] = f->address;
+   return depth;
+}
+
+static void timeline_define (StackTrace * it)
+{
+   const void * frames [MAX_STACK_SIZE];
+   size_t depth = stack_frames (it, frames);
+
+   timeline_byte ('S');
+   timeline_uleb (stack_index (it));
+   timeline_uleb (depth);
+   uintptr_t previous = 0;
+   for (size_t i = 0; i != depth; ++i) {
+      timeline_sleb ((uintptr_t) frames[i] - previous);
+      previous = (uintptr_t) frames[i];
+   }
+   it->defined = 1;
+}
+
+/* Unmap the file and cut it after the last tick.  The lock must be held.  */
+static void timeline_close (void)
+{
+   sys_munmap (timeline.map, timeline.size);
+   if (ftruncate (timeline.fd, timeline.ticked) != 0)
+      dprintf (STDERR_FILENO, "mtrace: cannot truncate timeline\n");
+   close (timeline.fd);
+   timeline.fd = -1;
+}
+
+/* Write a tick: the changes since the last.  */
+static void timeline_tick (void)
+{
+   pthread_mutex_lock (&timeline.lock);
+   if (timeline.fd < 0) {
+      pthread_mutex_unlock (&timeline.lock);
+      return;
+   }
+
+   timeline_modules();
+
+   /* Define new stacks, and count the changes.  */
+   size_t count = 0;
+   for (StackTrace ** bucket = stack_hash;
+	bucket != stack_hash + STACK_HASH_SIZE; ++bucket)
+      for (StackTrace * it = __atomic_load_n (bucket, __ATOMIC_ACQUIRE);
+	   it; it = it->next)
+	 if (__atomic_load_n (&it->bytes, __ATOMIC_RELAXED) != it->logged) {
+	    if (!it->defined)
+	       timeline_define (it);
+	    ++count;
+	 }
+
+   /* Then write them, in index order.  The hash chains aren't in order, so
+    * walk the stack pool.  */
+   uint64_t tick = now();
+   timeline_byte ('T');
+   timeline_uleb (tick - timeline.last_tick);
+   timeline.last_tick = tick;
+   timeline_uleb (count);
+
+   size_t previous = 0;
+   size_t stacks = __atomic_load_n (&stack_pool.used, __ATOMIC_RELAXED)
+      / sizeof (StackTrace);
+   if (stacks > 1UL << STACK_INDEX_BITS)
+      stacks = 1UL << STACK_INDEX_BITS;
+   for (size_t i = 0; i != stacks && count != 0; ++i) {
+      StackTrace * it = stack_at (i);
+      /* Pool slots that are unused, or were freed, are not defined.  */
+      if (!it->defined)
+	 continue;
+      ssize_t bytes = __atomic_load_n (&it->bytes, __ATOMIC_RELAXED);
+      if (bytes == it->logged)
+	 continue;
+      timeline_uleb (i - previous);
+      timeline_sleb (bytes - it->logged);
+      it->logged = bytes;
+      previous = i;
+      --count;
+   }
+   /* Any stacks that changed back in the meantime are written as no
+    * change.  */
+   while (count--) {
+      timeline_uleb (0);
+      timeline_sleb (0);
+   }
+
+   if (!timeline.full)
+      timeline.ticked = timeline.used;
+   else {
+      dprintf (STDERR_FILENO, "mtrace: cannot grow timeline, stopping it\n");
+      timeline_close();
+   }
+
+   pthread_mutex_unlock (&timeline.lock);
+}
+
+static void * timeline_thread (void * interval)
+{
+   /* Nothing we do here should be traced.  */
+   ++depth;
+
+   struct timespec ts;
+   ts.tv_sec = (uintptr_t) interval / 1000;
+   ts.tv_nsec = (uintptr_t) interval % 1000 * 1000000;
+   for (;;) {
+      nanosleep (&ts, NULL);
+      timeline_tick();
+   }
+   return NULL;
+}
+
+static void timeline_start (void)
+{
+   const char * file_name = getenv ("MTRACE_TIMELINE");
+   if (file_name == NULL || *file_name == 0)
+      return;
+
+   const char * interval_string = getenv ("MTRACE_TIMELINE_INTERVAL");
+   uintptr_t interval = interval_string ? strtoul (interval_string, NULL, 0)
+      : 1000;
+   if (interval == 0)
+      interval = 1000;
+
+   timeline.fd = open (file_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+		       0666);
+   if (timeline.fd < 0) {
+      dprintf (STDERR_FILENO, "mtrace: cannot open %s: %s\n",
+	       file_name, strerror (errno));
+      return;
+   }
+
+   timeline.size = 1 << 20;
+   if (posix_fallocate (timeline.fd, 0, timeline.size) != 0
+       || (timeline.map = sys_mmap (NULL, timeline.size,
+				    PROT_READ | PROT_WRITE, MAP_SHARED,
+				    timeline.fd, 0)) == MAP_FAILED) {
+      close (timeline.fd);
+      timeline.fd = -1;
+      return;
+   }
+
+   memcpy (timeline.map, "MTRACETL", 8);
+   timeline.used = 8;
+   timeline.ticked = 8;
+   timeline.last_tick = start_time;
+
+   start_thread (timeline_thread, (void *) interval);
+}
+
+/* Write the last tick, and trim the file to the data.  */
+static void timeline_stop (void)
+{
+   if (timeline.fd < 0)
+      return;
+
+   timeline_tick();
+
+   pthread_mutex_lock (&timeline.lock);
+   if (timeline.fd >= 0)
+      timeline_close();
+   pthread_mutex_unlock (&timeline.lock);
+}
+#else
+static void timeline_start (void) { }
+static void timeline_stop (void) { }
+#endif
+
 static void start (void) __attribute__ ((constructor));
 static void stop (void);
 
 static void handler (int signal)
 {
-   need_report = 1;
+   request_report();
 }
 
 void start (void)
 {
+   /* Reports allocate from the real allocator, without going through the
+    * wrappers.  */
+   real_ready();
+
    struct sigaction action;
    action.sa_handler = handler;
    action.sa_flags = SA_RESTART;
@@ -558,6 +3081,14 @@ void start (void)
    const char * offset_string = getenv ("MTRACE_OFFSETS");
    report_offsets = (offset_string != NULL && *offset_string != 0);
 
+   const char * resident_string = getenv ("MTRACE_RESIDENT");
+   report_resident = (resident_string != NULL && *resident_string != 0);
+
+   start_time = last_report_time = now();
+
+   reporter_start();
+   timeline_start();
+
    atexit (stop);
 }
 
@@ -568,4 +3099,6 @@ void stop (void)
    print_report();
 
    leave();
+
+   timeline_stop();
 }
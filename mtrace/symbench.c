@@ -0,0 +1,225 @@
+
+/* Symbol lookup microbenchmark.
+ *
+ * Usage: symbench [lookups] [library...]
+ *
+ * Each library (default libc and libstdc++) is dlopen'd, and its symbols are
+ * read with libelf as elftest does.  Random addresses inside those symbols are
+ * then looked up three ways: the old layout (an array of address/size/name
+ * structs, qsort'd and bisected), the symbol table's tree index one address at
+ * a time, and reflect_symtab_lookup_batch.  */
+
+#include <ctype.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <gelf.h>
+#include <libelf.h>
+#include <link.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "symboltable.h"
+
+/* The symbol layout that symboltable.c used to search.  */
+typedef struct Symbol
+{
+  const void * address;
+  size_t       size;
+  const char * name;
+} Symbol;
+
+static Symbol * symbols;
+static size_t   symbols_count;
+
+static int compare_symbol (const void * a, const void * b)
+{
+  const Symbol * aa = a;
+  const Symbol * bb = b;
+  return aa->address == bb->address ? 0 :
+    aa->address < bb->address ? -1 : 1;
+}
+
+/* Add the function and object symbols of filename, loaded at base.  */
+static void read_symbols (const char * filename, uintptr_t base)
+{
+  int fd = open (filename, O_RDONLY);
+  if (fd == -1) {
+    perror (filename);
+    exit (EXIT_FAILURE);
+  }
+
+  Elf * elf = elf_begin (fd, ELF_C_READ_MMAP, NULL);
+  if (elf == NULL) {
+    fprintf (stderr, "Cannot get Elf descriptor: %s\n", elf_errmsg (-1));
+    exit (EXIT_FAILURE);
+  }
+
+  /* Try for a symtab, then a dynsym.  */
+  Elf_Scn *   section = NULL;
+  GElf_Shdr   shdr;
+  while ((section = elf_nextscn (elf, section)))
+    if (gelf_getshdr (section, &shdr)->sh_type == SHT_SYMTAB)
+      break;
+  if (section == NULL)
+    while ((section = elf_nextscn (elf, section)))
+      if (gelf_getshdr (section, &shdr)->sh_type == SHT_DYNSYM)
+	break;
+
+  Elf_Data * data = section ? elf_getdata (section, NULL) : NULL;
+  if (data == NULL) {
+    fprintf (stderr, "Cannot find symbol table in %s.\n", filename);
+    exit (EXIT_FAILURE);
+  }
+
+  size_t num_syms = shdr.sh_size / shdr.sh_entsize;
+  size_t first = symbols_count;
+  symbols = realloc (symbols, (symbols_count + num_syms) * sizeof (Symbol));
+  if (symbols == NULL) {
+    perror ("realloc");
+    exit (EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i != num_syms; ++i) {
+    GElf_Sym sym;
+    gelf_getsym (data, i, &sym);
+    if ((GELF_ST_TYPE (sym.st_info) != STT_FUNC &&
+	 GELF_ST_TYPE (sym.st_info) != STT_OBJECT) || sym.st_value == 0)
+      continue;
+
+    Symbol * s = &symbols[symbols_count++];
+    s->address = (const char *) (base + sym.st_value);
+    s->size = sym.st_size ? sym.st_size : 16;
+    /* Names are not needed after the benchmark, so leak the elf.  */
+    s->name = elf_strptr (elf, shdr.sh_link, sym.st_name);
+  }
+
+  printf ("%s: %zu symbols\n", filename, symbols_count - first);
+}
+
+/* The old lookup: bisect the array of structs.  */
+static const Symbol * bisect (const void * address)
+{
+  const Symbol * s = symbols;
+  size_t range = symbols_count;
+  while (range > 1)
+    if (s[range / 2].address <= address) {
+      s += range / 2;
+      range -= range / 2;
+    }
+    else
+      range /= 2;
+
+  if ((size_t) (((char *) address) - ((char *) s->address)) > s->size)
+    return NULL;
+
+  return s;
+}
+
+static double now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report (const char * what, size_t lookups, double seconds,
+		    uintptr_t checksum)
+{
+  printf ("%-24s %12.0f lookups/s  (%#zx)\n",
+	  what, lookups / seconds, (size_t) checksum);
+}
+
+int main (int argc, char ** argv)
+{
+  static const char * defaults[] = { "libc.so.6", "libstdc++.so.6" };
+  const char ** libraries = defaults;
+  int           libraries_count = 2;
+  size_t        lookups = 4000000;
+
+  if (argc > 1 && isdigit (argv[1][0])) {
+    lookups = strtoul (argv[1], NULL, 0);
+    --argc;
+    ++argv;
+  }
+  if (argc > 1) {
+    libraries = (const char **) argv + 1;
+    libraries_count = argc - 1;
+  }
+
+  elf_version (EV_CURRENT);
+
+  for (int i = 0; i != libraries_count; ++i) {
+    void * handle = dlopen (libraries[i], RTLD_NOW);
+    struct link_map * map;
+    if (handle == NULL || dlinfo (handle, RTLD_DI_LINKMAP, &map) != 0) {
+      fprintf (stderr, "%s\n", dlerror());
+      exit (EXIT_FAILURE);
+    }
+    read_symbols (map->l_name, map->l_addr);
+  }
+
+  qsort (symbols, symbols_count, sizeof (Symbol), compare_symbol);
+
+  /* Random addresses inside random symbols.  */
+  const void ** addresses = malloc (lookups * sizeof (void *));
+  reflect_symtab_result * results
+    = malloc (lookups * sizeof (reflect_symtab_result));
+  if (addresses == NULL || results == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+
+  srandom (1);
+  for (size_t i = 0; i != lookups; ++i) {
+    const Symbol * s = &symbols[random() % symbols_count];
+    addresses[i] = (const char *) s->address + random() % s->size;
+  }
+
+  /* Load the symbol tables before timing anything.  */
+  reflect_symtab_create();
+  reflect_symtab_lookup_batch (addresses, lookups, results);
+
+  uintptr_t checksum = 0;
+  double start = now();
+  for (size_t i = 0; i != lookups; ++i) {
+    const Symbol * s = bisect (addresses[i]);
+    checksum += s ? (uintptr_t) s->address : 0;
+  }
+  report ("qsort + bisect", lookups, now() - start, checksum);
+
+  checksum = 0;
+  start = now();
+  for (size_t i = 0; i != lookups; ++i) {
+    reflect_symtab_lookup (&results[i].object, &results[i].symbol,
+			   &results[i].offset, addresses[i]);
+    checksum += (uintptr_t) addresses[i] - results[i].offset;
+  }
+  report ("reflect_symtab_lookup", lookups, now() - start, checksum);
+
+  checksum = 0;
+  start = now();
+  reflect_symtab_lookup_batch (addresses, lookups, results);
+  for (size_t i = 0; i != lookups; ++i)
+    checksum += (uintptr_t) addresses[i] - results[i].offset;
+  report ("reflect_symtab_batch", lookups, now() - start, checksum);
+
+  /* The symbol table may have read a different symbol set, e.g., from
+     debuginfo, so disagreements are reported rather than fatal.  */
+  size_t disagree = 0;
+  for (size_t i = 0; i != lookups; ++i) {
+    const Symbol * s = bisect (addresses[i]);
+    if (s == NULL || results[i].symbol == NULL
+	|| (const char *) addresses[i] - results[i].offset
+	   != (const char *) s->address)
+      ++disagree;
+  }
+  printf ("%zu of %zu lookups disagree.\n", disagree, lookups);
+
+  reflect_symtab_destroy();
+
+  return 0;
+}
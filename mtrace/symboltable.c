@@ -5,42 +5,127 @@
 #include <gelf.h>
 #include <libelf.h>
 #include <link.h>
+#include <lzma.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "symboltable.h"
 
 /* Do-it-ourself symbol table handling using libelf.  */
 
+/* A symbol as read from the ELF symbol table, used while building an
+ * index.  */
 typedef struct ElfSymbol
 {
-   const void * address;	/* The actual address in memory.  */
+   uint64_t     address;	/* Link-time address in the object.  */
    size_t       size;		/* Size of the symbol.  */
    const char * name;
 } ElfSymbol;
 
+/* A symbol index.
+ *
+ * The symbols of an object are kept as parallel arrays of addresses, sizes
+ * and name offsets into a string pool, all following this header.  Addresses
+ * are link-time addresses in the object, so an index is valid for every
+ * process mapping the object.  The layout is the same in memory and in the
+ * on-disk cache, so a cached index is used straight from its mmap.
+ *
+ * For searching, the addresses are also laid out as a static B-tree: nodes of
+ * TREE_ORDER keys, one cache line each, node k having children
+ * k * (TREE_ORDER + 1) + 1 ... k * (TREE_ORDER + 1) + TREE_ORDER + 1.  A
+ * lookup touches one line per level, log9 rather than log2 lines.  Each tree
+ * key has a parallel rank, its position in the sorted arrays; padding keys
+ * are UINT64_MAX with rank count.  */
+#define SYMBOL_INDEX_MAGIC   "SCGSYMX"
+#define SYMBOL_INDEX_VERSION 2
+
+#define TREE_ORDER 8
+
+typedef struct SymbolIndex
+{
+    char         magic[8];
+    uint32_t     version;
+    uint32_t     count;                 /* Number of symbols.  */
+    uint64_t     strings_size;          /* Bytes in the string pool.  */
+    uint64_t     size;                  /* Total bytes including header.  */
+    uint64_t     nodes;                 /* Number of tree nodes.  */
+    uint64_t     reserved[3];           /* Pad to a cache line.  */
+} SymbolIndex;
+
+static inline const uint64_t * index_tree_keys (const SymbolIndex * x)
+{
+    return (const uint64_t *) (x + 1);
+}
+
+static inline const uint32_t * index_tree_ranks (const SymbolIndex * x)
+{
+    return (const uint32_t *) (index_tree_keys (x) + TREE_ORDER * x->nodes);
+}
+
+static inline const uint64_t * index_addresses (const SymbolIndex * x)
+{
+    return (const uint64_t *) (index_tree_ranks (x) + TREE_ORDER * x->nodes);
+}
+
+static inline const uint32_t * index_sizes (const SymbolIndex * x)
+{
+    return (const uint32_t *) (index_addresses (x) + x->count);
+}
+
+static inline const uint32_t * index_names (const SymbolIndex * x)
+{
+    return index_sizes (x) + x->count;
+}
+
+static inline const char * index_strings (const SymbolIndex * x)
+{
+    return (const char *) (index_names (x) + x->count);
+}
+
+/* Total size of an index.  */
+static inline uint64_t index_bytes (uint64_t count, uint64_t strings_size)
+{
+    uint64_t nodes = (count + TREE_ORDER - 1) / TREE_ORDER;
+    return sizeof (SymbolIndex) + 12 * TREE_ORDER * nodes
+        + 16 * count + strings_size;
+}
+
 /* A struct representing an ELF object in memory.  */
 typedef struct ElfObject
 {
     const void * address;               /* Start of first PT_LOAD segment.  */
     size_t       size;                /* Size to cover all PT_LOAD segments.  */
+    size_t       base;                  /* Load bias from dl_iterate_phdr.  */
     ssize_t      delta;                 /* mapped address - object address.  */
 
     /* Name and file name.  filename is set to NULL on load failure.  */
     const char * name;
     const char * filename;
 
-    /* libelf object.  Maybe null.  */
+    /* GNU build-id note, in the mapped object.  Maybe null.  */
+    const unsigned char * build_id;
+    size_t       build_id_size;
+
+    /* The mapped .eh_frame_hdr, from PT_GNU_EH_FRAME.  Maybe null.  */
+    const unsigned char * eh_frame_hdr;
+
+    /* libelf object.  Maybe null.  Only open while building the index.  */
     Elf *        elf;
     /* File descriptor.  -1 means none.  */
     int          fd;
 
-    /* Number and array of symbols.  */
-    size_t       symbols_count;
-    ElfSymbol *  symbols;
+    /* Symbol index; null until loaded.  index_mapped is set if the index is
+       mmap'd from the cache rather than malloc'd.  */
+    const SymbolIndex * index;
+    int          index_mapped;
 } ElfObject;
 
 /* Storage for the known elf objects.  */
@@ -56,22 +141,43 @@ static const char * main_program_path (void)
    return saved;
 }
 
-/* Append one elf object to the array.  */
-static int build_elf_object_1 (struct dl_phdr_info * info,
-			       size_t size, void * unused)
+/* Find the GNU build-id note in the mapped object.  The notes are part of a
+   PT_LOAD segment, so there is no need to open the file.  */
+static void find_build_id (ElfObject * it, struct dl_phdr_info * info)
 {
-    /* Reallocate the array.  We're not performance critical, so reallocing
-       item by item is fine.  */
-    ElfObject * it = realloc (elf_object_array,
-                              (elf_object_count + 1) * sizeof (ElfObject));
-    if (it == NULL)
-        return 1;
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) * header = &info->dlpi_phdr[i];
+        if (header->p_type != PT_NOTE)
+            continue;
 
-    elf_object_array = it;
-    it += elf_object_count++;
+        size_t align = header->p_align == 8 ? 8 : 4;
+        const char * p = (const char *) (info->dlpi_addr + header->p_vaddr);
+        const char * end = p + header->p_memsz;
+        while (p + sizeof (ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) * note = (const ElfW(Nhdr) *) p;
+            const char * name = (const char *) (note + 1);
+            const char * desc = name + ((note->n_namesz + align - 1) & -align);
+            if (desc + note->n_descsz > end)
+                break;
+
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4
+                && memcmp (name, "GNU", 4) == 0 && note->n_descsz != 0) {
+                it->build_id = (const unsigned char *) desc;
+                it->build_id_size = note->n_descsz;
+                return;
+            }
+
+            p = desc + ((note->n_descsz + align - 1) & -align);
+        }
+    }
+}
 
+/* Set up an elf object from its program headers.  */
+static void init_elf_object (ElfObject * it, struct dl_phdr_info * info)
+{
     /* The dlpi_addr field appears to be a misnomer.  It appears to be the
        difference between the object's address and the mapped address.  */
+    it->base = info->dlpi_addr;
     it->delta = info->dlpi_addr;
 
     /* Find the address range...  */
@@ -92,11 +198,13 @@ static int build_elf_object_1 (struct dl_phdr_info * info,
     it->address = ((char *) min_vaddress) + it->delta;
     it->size = max_vaddress - min_vaddress;
 
-    /* Assume that no name is the main program...  */
+    /* Assume that no name is the main program...  Check the program headers
+       too, as a PIE main program is not ET_EXEC.  */
     it->name = info->dlpi_name;
     it->filename = it->name;
     if (it->name == NULL || it->name[0] == '\0') {
-        if (((Elf32_Ehdr *) it->address)->e_type == ET_EXEC) {
+        if (((Elf32_Ehdr *) it->address)->e_type == ET_EXEC
+            || info->dlpi_phdr == (const void *) getauxval (AT_PHDR)) {
             it->name = program_invocation_short_name;
             it->filename = main_program_path();
         }
@@ -106,16 +214,42 @@ static int build_elf_object_1 (struct dl_phdr_info * info,
         }
     }
 
+    it->build_id = NULL;
+    it->build_id_size = 0;
+    find_build_id (it, info);
+
+    it->eh_frame_hdr = NULL;
+    for (int i = 0; i < info->dlpi_phnum; ++i)
+        if (info->dlpi_phdr[i].p_type == PT_GNU_EH_FRAME)
+            it->eh_frame_hdr = (const unsigned char *)
+                (info->dlpi_addr + info->dlpi_phdr[i].p_vaddr);
+
     it->elf = 0;
     it->fd = -1;
-    it->symbols_count = 0;
-    it->symbols = NULL;
+    it->index = NULL;
+    it->index_mapped = 0;
 
 #ifdef DEBUG
     fprintf (stderr, "%s at %p size %u delta %x\n",
              it->name, it->address, it->size, it->delta);
 #endif
+}
+
+/* Append one elf object to the array.  */
+static int build_elf_object_1 (struct dl_phdr_info * info,
+			       size_t size, void * unused)
+{
+    /* Reallocate the array.  We're not performance critical, so reallocing
+       item by item is fine.  */
+    ElfObject * it = realloc (elf_object_array,
+                              (elf_object_count + 1) * sizeof (ElfObject));
+    if (it == NULL)
+        return 1;
 
+    elf_object_array = it;
+    it += elf_object_count++;
+
+    init_elf_object (it, info);
     return 0;
 }
 
@@ -128,23 +262,6 @@ static int compare_elf_object (const void * a, const void * b)
       aa->address < bb->address ? -1 : 1;
 }
 
-/* Create the array of elf objects.  */
-void reflect_symtab_create (void)
-{
-   elf_version (EV_CURRENT);
-
-   if (elf_object_array != NULL)
-      reflect_symtab_destroy();
-
-   dl_iterate_phdr (build_elf_object_1, NULL);
-
-   /* Sort it so we can look up by binary search.  */
-   qsort (elf_object_array, elf_object_count, sizeof (ElfObject),
-	  compare_elf_object);
-
-   return;
-}
-
 /* Comparison function for sorting an array of symbols.  */
 static int compare_elf_symbol (const void * a, const void * b)
 {
@@ -211,6 +328,42 @@ static void close_elf (Elf * elf, int fd)
 }
 
 
+/* Open a separate debug file, if it exists.  */
+static Elf * open_debug_elf (const char * path, int * fd)
+{
+#ifdef DEBUG
+    fprintf (stderr, "Trying debug file %s\n", path);
+#endif
+    if (access (path, R_OK) != 0)
+        return NULL;
+
+    return open_elf (path, fd);
+}
+
+
+/* Look for a debug file named by build-id:
+   /usr/lib/debug/.build-id/xx/yyyy.debug.  */
+static Elf * get_build_id_debug (ElfObject * it, int * dbgfd)
+{
+    if (it->build_id == NULL || it->build_id_size < 2)
+        return NULL;
+
+    char hex [2 * it->build_id_size + 1];
+    for (size_t i = 0; i != it->build_id_size; ++i)
+        sprintf (hex + 2 * i, "%02x", it->build_id[i]);
+
+    char * debug_path;
+    if (asprintf (&debug_path, "/usr/lib/debug/.build-id/%.2s/%s.debug",
+                  hex, hex + 2) < 0)
+        return NULL;
+
+    Elf * debug_elf = open_debug_elf (debug_path, dbgfd);
+    free (debug_path);
+
+    return debug_elf;
+}
+
+
 /* Follow .gnu_debuglink if possible.  */
 static Elf * get_debuglink (ElfObject * it, int * dbgfd)
 {
@@ -246,7 +399,7 @@ static Elf * get_debuglink (ElfObject * it, int * dbgfd)
 #endif
 
     /* Now try and load the debug info elf object.  */
-    Elf * debug_elf = open_elf (debug_path, dbgfd);
+    Elf * debug_elf = open_debug_elf (debug_path, dbgfd);
     free (debug_path);
 
     return debug_elf;
@@ -267,159 +420,984 @@ static void replace_elf (ElfObject * it, Elf * elf, int fd)
 }
 
 
-/* Get an elf object symbol table.  */
-static Elf_Scn * get_symtab (ElfObject * it, GElf_Shdr * header)
+/* Symbols gathered for an index, and what keeps their names alive.  */
+typedef struct SymbolSource
 {
-    it->elf = open_elf (it->filename, &it->fd);
-    if (it->elf == NULL) {
-        it->filename = NULL;
+    ElfSymbol * symbols;
+    size_t      count;
+
+    /* Set if we found a full symtab, which covers every function.  */
+    int         complete;
+
+    /* MiniDebugInfo, decompressed from .gnu_debugdata.  */
+    Elf *       mini_elf;
+    char *      mini_data;
+
+    /* Names made up for functions found only in .eh_frame.  */
+    char *      fde_names;
+} SymbolSource;
+
+
+/* Append the function and object symbols of a symbol table section.  */
+static void add_symbols (SymbolSource * source, const ElfObject * it,
+                         Elf * elf, Elf_Scn * section,
+                         const GElf_Shdr * header)
+{
+    /* Get the symbol table data.  */
+    Elf_Data * symbol_data = elf_getdata (section, NULL);
+    if (symbol_data == NULL || header->sh_entsize == 0) {
+        fprintf (stderr, "No section data in %s\n", it->name);
+        return;
+    }
+
+    /* Number of symbols.  We won't actually be interested in them all, but it's
+     * not going to be excessively large.  */
+    size_t symbol_count = header->sh_size / header->sh_entsize;
+
+    /* We count the exact number of symbols we're interested in; saves us 4k
+     * entries on libc.  */
+    size_t wanted = 0;
+    for (size_t i = 0; i != symbol_count; ++i) {
+        GElf_Sym symbol;
+        gelf_getsym (symbol_data, i, &symbol);
+        /* We're only interested in symbols that are defined functions.  Ignore
+         * others.  */
+        if ((GELF_ST_TYPE (symbol.st_info) == STT_FUNC ||
+             GELF_ST_TYPE (symbol.st_info) == STT_OBJECT)
+             && symbol.st_value != 0)
+            ++wanted;
+    }
+
+    if (wanted == 0)
+        return;
+
+    ElfSymbol * symbols = realloc (source->symbols, (source->count + wanted)
+                                   * sizeof (ElfSymbol));
+    if (symbols == NULL) {
+        fprintf (stderr, "Malloc symbol array failed in %s\n", it->name);
+        return;
+    }
+    source->symbols = symbols;
+
+    for (size_t i = 0; i != symbol_count; ++i) {
+        GElf_Sym symbol;
+        gelf_getsym (symbol_data, i, &symbol);
+        ElfSymbol * s = &source->symbols[source->count];
+
+        /* We're only interested in symbols that are defined functions.  It
+         * appears that some real functions get marked as undefined!  So test
+         * for symbol value != 0 instead.  */
+        if ((GELF_ST_TYPE (symbol.st_info) != STT_FUNC &&
+             GELF_ST_TYPE (symbol.st_info) != STT_OBJECT)
+            || symbol.st_value == 0)
+            continue;
+
+        /* Index addresses are relative to the load bias of the mapped object,
+           which differs from delta if we're reading a prelinked debug
+           file.  */
+        s->address = symbol.st_value + it->delta - it->base;
+        s->size = symbol.st_size;
+        if (s->size == 0)
+            s->size = 16;
+        s->name = elf_strptr (elf, header->sh_link, symbol.st_name);
+        if (s->name == NULL)
+            s->name = "";
+
+        ++source->count;
+    }
+
+#ifdef DEBUG
+    fprintf (stderr, "Grokked %zu symbols out of %zu for %s\n",
+             wanted, symbol_count, it->name);
+#endif
+}
+
+
+/* Decompress an xz stream into a malloc'd buffer.  */
+static char * decompress_xz (const void * data, size_t size,
+                             size_t * result_size)
+{
+    lzma_stream stream = LZMA_STREAM_INIT;
+    if (lzma_stream_decoder (&stream, UINT64_MAX, 0) != LZMA_OK)
+        return NULL;
+
+    size_t capacity = 4 * size + 4096;
+    char * result = malloc (capacity);
+    stream.next_in = data;
+    stream.avail_in = size;
+
+    while (result != NULL) {
+        stream.next_out = (uint8_t *) result + stream.total_out;
+        stream.avail_out = capacity - stream.total_out;
+
+        lzma_ret ret = lzma_code (&stream, LZMA_FINISH);
+        if (ret == LZMA_STREAM_END)
+            break;
+
+        if (ret != LZMA_OK && ret != LZMA_BUF_ERROR) {
+            free (result);
+            result = NULL;
+            break;
+        }
+
+        if (stream.avail_out == 0) {
+            capacity *= 2;
+            char * bigger = realloc (result, capacity);
+            if (bigger == NULL)
+                free (result);
+            result = bigger;
+        }
+        else if (ret == LZMA_BUF_ERROR) {
+            /* No progress possible: truncated input.  */
+            free (result);
+            result = NULL;
+        }
+    }
+
+    *result_size = stream.total_out;
+    lzma_end (&stream);
+    return result;
+}
+
+
+/* Open the MiniDebugInfo in .gnu_debugdata: an xz-compressed ELF file holding
+ * a symtab of the functions missing from .dynsym.  */
+static Elf * get_minidebuginfo (ElfObject * it, SymbolSource * source)
+{
+    GElf_Shdr header;
+    Elf_Scn * section = get_elf_section (it->elf, SHT_PROGBITS,
+                                         ".gnu_debugdata", &header);
+    if (section == NULL)
+        return NULL;
+
+    Elf_Data * data = elf_rawdata (section, NULL);
+    if (data == NULL)
+        return NULL;
+
+    size_t size;
+    source->mini_data = decompress_xz (data->d_buf, data->d_size, &size);
+    if (source->mini_data == NULL) {
+        fprintf (stderr, "%s: bad .gnu_debugdata\n", it->name);
         return NULL;
     }
 
-    Elf_Scn * section = get_elf_section (it->elf, SHT_SYMTAB, NULL, header);
+    source->mini_elf = elf_memory (source->mini_data, size);
+    return source->mini_elf;
+}
+
+
+/* Gather an object's symbols.  We prefer, in order: the object's own symtab;
+ * the symtab of a separate debug file, found by build-id or by
+ * .gnu_debuglink; the dynsym merged with any MiniDebugInfo symtab; the debug
+ * file's dynsym.  Returns zero if the object cannot be opened.  */
+static int get_symbols (ElfObject * it, SymbolSource * source)
+{
+    GElf_Shdr header;
+
+    it->elf = open_elf (it->filename, &it->fd);
+    if (it->elf == NULL)
+        return 0;
+
+    Elf_Scn * section = get_elf_section (it->elf, SHT_SYMTAB, NULL, &header);
     if (section != NULL) {
 //#ifdef DEBUG
         fprintf (stderr, "%s: SYMTAB\n", it->name);
 //#endif
-        return section;
+        add_symbols (source, it, it->elf, section, &header);
+        source->complete = 1;
+        return 1;
     }
 
-    int debug_fd;
-    Elf * debug = get_debuglink (it, &debug_fd);
+    int debug_fd = -1;
+    Elf * debug = get_build_id_debug (it, &debug_fd);
+    if (debug == NULL)
+        debug = get_debuglink (it, &debug_fd);
 
     if (debug != NULL) {
-        section = get_elf_section (debug, SHT_SYMTAB, NULL, header);
+        section = get_elf_section (debug, SHT_SYMTAB, NULL, &header);
         if (section != NULL) {
 //#ifdef DEBUG
             fprintf (stderr, "%s: SYMTAB (debuginfo)\n", it->name);
 //#endif
             replace_elf (it, debug, debug_fd);
-            return section;
+            add_symbols (source, it, it->elf, section, &header);
+            source->complete = 1;
+            return 1;
         }
     }
 
-    section = get_elf_section (it->elf, SHT_DYNSYM, NULL, header);
-    if (section != NULL)
+    section = get_elf_section (it->elf, SHT_DYNSYM, NULL, &header);
+    if (section != NULL) {
+        Elf * mini = get_minidebuginfo (it, source);
+        Elf_Scn * mini_section = NULL;
+        GElf_Shdr mini_header;
+        if (mini != NULL)
+            mini_section = get_elf_section (mini, SHT_SYMTAB, NULL,
+                                            &mini_header);
 //#ifdef DEBUG
-        fprintf (stderr, "%s: DYNSYM\n", it->name);
+        fprintf (stderr, "%s: DYNSYM%s\n", it->name,
+                 mini_section ? " + MiniDebugInfo" : "");
 //#endif
+        add_symbols (source, it, it->elf, section, &header);
+        if (mini_section != NULL) {
+            add_symbols (source, it, mini, mini_section, &mini_header);
+            source->complete = 1;
+        }
+    }
 
     if (section == NULL && debug != NULL) {
-        section = get_elf_section (debug, SHT_DYNSYM, NULL, header);
+        section = get_elf_section (debug, SHT_DYNSYM, NULL, &header);
         if (section != NULL) {
 //#ifdef DEBUG
             fprintf (stderr, "%s: DYNSYM (debuginfo)\n", it->name);
 //#endif
             replace_elf (it, debug, debug_fd);
-            return section;
+            add_symbols (source, it, it->elf, section, &header);
+            return 1;
         }
     }
 
+    if (section == NULL)
+        fprintf (stderr, "No symbol data in %s\n", it->name);
+
     close_elf (debug, debug_fd);
-    return section;
+    return 1;
 }
 
 
-static void fill_in_elf_object (ElfObject * it)
+/* Function ranges from .eh_frame.
+ *
+ * Stripped code still has unwind tables: every function has an FDE giving its
+ * start address and length, and .eh_frame_hdr has a sorted table of them.  We
+ * read the copy mapped in memory, so all the pointer encodings can be resolved
+ * directly.  */
+#define DW_EH_PE_omit    0xff
+#define DW_EH_PE_uleb128 0x01
+#define DW_EH_PE_udata2  0x02
+#define DW_EH_PE_udata4  0x03
+#define DW_EH_PE_udata8  0x04
+#define DW_EH_PE_sleb128 0x09
+#define DW_EH_PE_sdata2  0x0a
+#define DW_EH_PE_sdata4  0x0b
+#define DW_EH_PE_sdata8  0x0c
+#define DW_EH_PE_pcrel   0x10
+#define DW_EH_PE_datarel 0x30
+#define DW_EH_PE_indirect 0x80
+
+static uint64_t read_uleb128 (const unsigned char ** p)
 {
-    /* If we're already filled in, or we've already failed, do nothing.  */
-    if (it->elf != NULL || it->filename == NULL)
-        return;
+    uint64_t result = 0;
+    unsigned shift = 0;
+    unsigned char byte;
+    do {
+        byte = *(*p)++;
+        if (shift < 64)
+            result |= (uint64_t) (byte & 0x7f) << shift;
+        shift += 7;
+    }
+    while (byte & 0x80);
+    return result;
+}
+
+static int64_t read_sleb128 (const unsigned char ** p)
+{
+    uint64_t result = 0;
+    unsigned shift = 0;
+    unsigned char byte;
+    do {
+        byte = *(*p)++;
+        if (shift < 64)
+            result |= (uint64_t) (byte & 0x7f) << shift;
+        shift += 7;
+    }
+    while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40))
+        result |= -((uint64_t) 1 << shift);
+    return result;
+}
+
+/* Read a pointer in one of the DW_EH_PE encodings.  Returns zero on an
+ * encoding we don't handle.  If apply is zero, only the value format is used,
+ * as for an FDE's address range.  */
+static int read_encoded (const unsigned char ** p, unsigned char encoding,
+                         uintptr_t datarel, int apply, uintptr_t * result)
+{
+    const unsigned char * start = *p;
+    uintptr_t value;
+
+    if (encoding == DW_EH_PE_omit)
+        return 0;
+
+#define READ(type) do { type v; memcpy (&v, *p, sizeof v);      \
+        *p += sizeof v; value = (uintptr_t) v; } while (0)
+    switch (encoding & 0x0f) {
+    case 0:                     READ (uintptr_t); break;
+    case DW_EH_PE_uleb128:      value = read_uleb128 (p); break;
+    case DW_EH_PE_udata2:       READ (uint16_t); break;
+    case DW_EH_PE_udata4:       READ (uint32_t); break;
+    case DW_EH_PE_udata8:       READ (uint64_t); break;
+    case DW_EH_PE_sleb128:      value = read_sleb128 (p); break;
+    case DW_EH_PE_sdata2:       READ (int16_t); break;
+    case DW_EH_PE_sdata4:       READ (int32_t); break;
+    case DW_EH_PE_sdata8:       READ (int64_t); break;
+    default:
+        return 0;
+    }
+#undef READ
+
+    if (apply) {
+        switch (encoding & 0x70) {
+        case 0:                 break;
+        case DW_EH_PE_pcrel:    value += (uintptr_t) start; break;
+        case DW_EH_PE_datarel:  value += datarel; break;
+        default:
+            return 0;
+        }
+
+        if (encoding & DW_EH_PE_indirect)
+            value = *(const uintptr_t *) value;
+    }
+
+    *result = value;
+    return 1;
+}
+
+/* Get the FDE pointer encoding from a CIE: the 'R' augmentation.  */
+static unsigned char cie_fde_encoding (const unsigned char * cie)
+{
+    const unsigned char * p = cie + 4;
+    if (*(const uint32_t *) cie == 0xffffffff)
+        p += 8;
+    p += 4;                                     /* CIE id.  */
+    unsigned char version = *p++;
+    const char * augmentation = (const char *) p;
+    p += strlen (augmentation) + 1;
+    if (strstr (augmentation, "eh") != NULL)
+        p += sizeof (uintptr_t);
+    read_uleb128 (&p);                          /* Code alignment.  */
+    read_sleb128 (&p);                          /* Data alignment.  */
+    if (version == 1)
+        ++p;                                    /* Return register.  */
+    else
+        read_uleb128 (&p);
+
+    if (augmentation[0] != 'z')
+        return 0;                               /* Absolute pointers.  */
+
+    read_uleb128 (&p);                          /* Augmentation length.  */
+    for (const char * a = augmentation + 1; *a; ++a)
+        switch (*a) {
+        case 'R':
+            return *p;
+        case 'P': {
+            unsigned char encoding = *p++;
+            uintptr_t ignored;
+            if (!read_encoded (&p, encoding, 0, 0, &ignored))
+                return DW_EH_PE_omit;
+            break;
+        }
+        case 'L':
+            ++p;
+            break;
+        case 'S':
+        case 'B':
+            break;
+        default:
+            return DW_EH_PE_omit;
+        }
+
+    return 0;
+}
+
+/* Get the address range of an FDE.  Consecutive FDEs usually share a CIE, so
+ * the caller keeps the last one and its encoding.  */
+static int fde_range (const unsigned char * fde, uintptr_t * start,
+                      uintptr_t * length, const unsigned char ** last_cie,
+                      unsigned char * last_encoding)
+{
+    const unsigned char * p = fde;
+    uint32_t length32;
+    memcpy (&length32, p, 4);
+    p += 4;
+    if (length32 == 0xffffffff)
+        p += 8;
+
+    /* The CIE pointer is relative to its own position.  */
+    uint32_t cie_offset;
+    memcpy (&cie_offset, p, 4);
+    const unsigned char * cie = p - cie_offset;
+    p += 4;
+
+    if (cie != *last_cie) {
+        *last_encoding = cie_fde_encoding (cie);
+        *last_cie = cie;
+    }
+
+    return read_encoded (&p, *last_encoding, 0, 1, start)
+        && read_encoded (&p, *last_encoding & 0x0f, 0, 0, length);
+}
+
+/* Add a made-up symbol, module+0xstart, for each function in the
+ * .eh_frame_hdr table that no symbol covers.  The symbols must already be
+ * sorted.  Returns non-zero if any were added.  */
+static int add_fde_symbols (const ElfObject * it, SymbolSource * source)
+{
+    const unsigned char * hdr = it->eh_frame_hdr;
+    if (hdr == NULL || hdr[0] != 1)
+        return 0;
+
+    const unsigned char * p = hdr + 4;
+    uintptr_t eh_frame;
+    uintptr_t fde_count;
+    unsigned char table_encoding = hdr[3];
+    if (!read_encoded (&p, hdr[1], (uintptr_t) hdr, 1, &eh_frame)
+        || !read_encoded (&p, hdr[2], (uintptr_t) hdr, 1, &fde_count)
+        || table_encoding != (DW_EH_PE_datarel | DW_EH_PE_sdata4)
+        || fde_count == 0)
+        return 0;
+
+    const char * module = strrchr (it->name, '/');
+    module = module ? module + 1 : it->name;
+    size_t name_size = strlen (module) + 2 + 2 * sizeof (uintptr_t) + 2;
+
+    ElfSymbol * symbols = realloc (source->symbols, (source->count + fde_count)
+                                   * sizeof (ElfSymbol));
+    if (symbols == NULL)
+        return 0;
+    source->symbols = symbols;
+
+    source->fde_names = malloc (fde_count * name_size);
+    if (source->fde_names == NULL)
+        return 0;
+
+    /* The table is pairs of 32-bit offsets from hdr: start, FDE.  */
+    const int32_t * table = (const int32_t *) p;
+    size_t symbol_count = source->count;
+    size_t s = 0;
+    size_t added = 0;
+    const unsigned char * last_cie = NULL;
+    unsigned char last_encoding = 0;
+    for (size_t i = 0; i != fde_count; ++i) {
+        uintptr_t start;
+        uintptr_t length;
+        if (!fde_range (hdr + table[2 * i + 1], &start, &length,
+                        &last_cie, &last_encoding)
+            || length == 0)
+            continue;
+
+        /* Skip it if a symbol covers the start.  Both lists are sorted.  */
+        uint64_t key = start - it->base;
+        while (s + 1 < symbol_count && symbols[s + 1].address <= key)
+            ++s;
+        if (symbol_count != 0 && symbols[s].address <= key
+            && key - symbols[s].address < symbols[s].size)
+            continue;
+
+        char * name = source->fde_names + added * name_size;
+        snprintf (name, name_size, "%s+%#tx", module,
+                  (ptrdiff_t) (start - (uintptr_t) it->address));
+
+        ElfSymbol * f = &source->symbols[source->count++];
+        f->address = key;
+        f->size = length;
+        f->name = name;
+        ++added;
+    }
 
 #ifdef DEBUG
-    fprintf (stderr, "Loading elf object %s\n", it->name);
+    fprintf (stderr, "%s: %zu functions from .eh_frame\n", it->name, added);
 #endif
+    return added != 0;
+}
+
+
+/* The directory holding cached symbol indexes, or NULL if caching is
+ * disabled.  $SCG_SYMBOL_CACHE overrides the default; setting it to the empty
+ * string disables the cache.  */
+static const char * symbol_cache_dir (void)
+{
+    static char saved [FILENAME_MAX + 1];
+    static int  done;
+    if (done)
+        return saved[0] ? saved : NULL;
+
+    done = 1;
+    const char * dir = getenv ("SCG_SYMBOL_CACHE");
+    const char * xdg = getenv ("XDG_CACHE_HOME");
+    const char * home = getenv ("HOME");
+    if (dir != NULL)
+        snprintf (saved, sizeof saved, "%s", dir);
+    else if (xdg != NULL && xdg[0] == '/')
+        snprintf (saved, sizeof saved, "%s/scg-symbols", xdg);
+    else if (home != NULL && home[0] == '/')
+        snprintf (saved, sizeof saved, "%s/.cache/scg-symbols", home);
+
+    return saved[0] ? saved : NULL;
+}
+
+
+/* The cache file name for an object, in a malloc'd buffer.  NULL if the
+ * object has no build-id or caching is disabled.  */
+static char * symbol_cache_path (const ElfObject * it)
+{
+    const char * dir = symbol_cache_dir();
+    if (dir == NULL || it->build_id == NULL)
+        return NULL;
+
+    char hex [2 * it->build_id_size + 1];
+    for (size_t i = 0; i != it->build_id_size; ++i)
+        sprintf (hex + 2 * i, "%02x", it->build_id[i]);
 
-    GElf_Shdr section_header;
-    Elf_Scn * section = get_symtab (it, &section_header);
-    if (section == NULL) {
-        fprintf (stderr, "No smbol data in %s\n", it->name);
-        goto failed;
+    char * path;
+    if (asprintf (&path, "%s/%s.symidx", dir, hex) < 0)
+        return NULL;
+
+    return path;
+}
+
+
+/* Check the contents of an index whose header is good: names must be inside
+ * the string pool, which must end in a null; addresses must be sorted; and
+ * tree ranks must be inside the arrays.  */
+static int index_contents_valid (const SymbolIndex * x)
+{
+    const uint64_t * addresses = index_addresses (x);
+    const uint32_t * names = index_names (x);
+    const uint32_t * ranks = index_tree_ranks (x);
+
+    if (x->strings_size != 0 && index_strings (x)[x->strings_size - 1] != '\0')
+        return 0;
+
+    for (size_t i = 0; i != x->count; ++i)
+        if (names[i] >= x->strings_size
+            || (i != 0 && addresses[i] < addresses[i - 1]))
+            return 0;
+
+    for (size_t i = 0; i != TREE_ORDER * x->nodes; ++i)
+        if (ranks[i] > x->count)
+            return 0;
+
+    return 1;
+}
+
+
+/* Try and map a cached index for the object.  Returns non-zero on
+ * success.  */
+static int load_cached_index (ElfObject * it)
+{
+    char * path = symbol_cache_path (it);
+    if (path == NULL)
+        return 0;
+
+    int fd = open (path, O_RDONLY);
+    free (path);
+    if (fd == -1)
+        return 0;
+
+    struct stat st;
+    void * map = MAP_FAILED;
+    if (fstat (fd, &st) == 0 && st.st_size >= sizeof (SymbolIndex))
+        map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close (fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    /* Validate before trusting it; the file may be stale or truncated.  */
+    const SymbolIndex * x = map;
+    if (memcmp (x->magic, SYMBOL_INDEX_MAGIC, sizeof x->magic) != 0
+        || x->version != SYMBOL_INDEX_VERSION
+        || x->size != st.st_size
+        || x->nodes != (x->count + TREE_ORDER - 1) / TREE_ORDER
+        || x->size != index_bytes (x->count, x->strings_size)
+        || !index_contents_valid (x)) {
+        munmap (map, st.st_size);
+        return 0;
     }
 
-    /* Get the symbol table data.  */
-    Elf_Data * symbol_data = elf_getdata (section, NULL);
-    if (symbol_data == NULL) {
-        fprintf (stderr, "No section data in %s\n", it->name);
-        goto failed;
+#ifdef DEBUG
+    fprintf (stderr, "%s: cached index, %u symbols\n", it->name, x->count);
+#endif
+    it->index = x;
+    it->index_mapped = 1;
+    return 1;
+}
+
+
+/* Create the directories leading to path.  */
+static void make_directories (char * path)
+{
+    for (char * p = strchr (path + 1, '/'); p; p = strchr (p + 1, '/')) {
+        *p = '\0';
+        mkdir (path, 0755);
+        *p = '/';
     }
+    mkdir (path, 0755);
+}
 
-    /* Number of symbols.  We won't actually be interested in them all, but it's
-     * not going to be excessively large.  */
-    size_t symbol_count = section_header.sh_size / section_header.sh_entsize;
-    if (symbol_count <= 0) {
-        fprintf (stderr, "No symbols in %s\n", it->name);
-        goto failed;
+
+/* Write the object's index to the cache.  The file is written under a
+ * temporary name and then renamed, so concurrent readers never see a partial
+ * index.  Failures are silently ignored.  */
+static void save_cached_index (const ElfObject * it)
+{
+    char * path = symbol_cache_path (it);
+    if (path == NULL)
+        return;
+
+    char * temp;
+    if (asprintf (&temp, "%s.%i", path, getpid()) < 0) {
+        free (path);
+        return;
     }
 
-    /* We count the exact number of symbols we're interested in; saves us 4k
-     * entries on libc.  */
-    size_t wanted = 0;
-    for (size_t i = 0; i != symbol_count; ++i) {
-        GElf_Sym symbol;
-        gelf_getsym (symbol_data, i, &symbol);
-        /* We're only interested in symbols that are defined functions.  Ignore
-         * others.  */
-        if ((GELF_ST_TYPE (symbol.st_info) == STT_FUNC ||
-             GELF_ST_TYPE (symbol.st_info) == STT_OBJECT)
-             && symbol.st_value != 0)
-            ++wanted;
+    int fd = open (temp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1 && errno == ENOENT) {
+        char * dir = strdup (symbol_cache_dir());
+        if (dir != NULL)
+            make_directories (dir);
+        free (dir);
+        fd = open (temp, O_WRONLY | O_CREAT | O_EXCL, 0644);
     }
 
-    /* Now build the symbol array.  */
-    it->symbols = malloc (wanted * sizeof (ElfSymbol));
-    if (it->symbols == NULL) {
-        fprintf (stderr, "Malloc symbol array failed in %s\n", it->name);
-        goto failed;
+    if (fd != -1) {
+        const char * p = (const char *) it->index;
+        size_t remaining = it->index->size;
+        while (remaining != 0) {
+            ssize_t n = write (fd, p, remaining);
+            if (n <= 0)
+                break;
+            p += n;
+            remaining -= n;
+        }
+
+        if (close (fd) != 0 || remaining != 0 || rename (temp, path) != 0)
+            unlink (temp);
     }
-    it->symbols_count = 0;
 
-    for (size_t i = 0; i != symbol_count; ++i) {
-        GElf_Sym symbol;
-        gelf_getsym (symbol_data, i, &symbol);
-        ElfSymbol * s = &it->symbols[it->symbols_count];
+    free (temp);
+    free (path);
+}
 
-        /* We're only interested in symbols that are defined functions.  It
-         * appears that some real functions get marked as undefined!  So test
-         * for symbol value != 0 instead.  */
-        if ((GELF_ST_TYPE (symbol.st_info) != STT_FUNC &&
-             GELF_ST_TYPE (symbol.st_info) != STT_OBJECT)
-            || symbol.st_value == 0)
-            continue;
 
-        /* st_value is 64 bits in the gelf stuff, so need to cast to
-           avoid warnings.  */
-        s->address = (const char *) (size_t) symbol.st_value + it->delta;
-        s->size = symbol.st_size;
-        if (s->size == 0)
-            s->size = 16;
-        s->name = elf_strptr (it->elf, section_header.sh_link, symbol.st_name);
+/* Fill in the tree nodes from node k down, in order, taking sorted keys from
+ * *next.  */
+static void build_tree (uint64_t * keys, uint32_t * ranks, size_t nodes,
+                        const uint64_t * addresses, size_t count,
+                        size_t k, size_t * next)
+{
+    if (k >= nodes)
+        return;
+
+    for (int i = 0; i != TREE_ORDER; ++i) {
+        build_tree (keys, ranks, nodes, addresses, count,
+                    k * (TREE_ORDER + 1) + i + 1, next);
+        if (*next < count) {
+            keys[k * TREE_ORDER + i] = addresses[*next];
+            ranks[k * TREE_ORDER + i] = *next;
+            ++*next;
+        }
+        else {
+            keys[k * TREE_ORDER + i] = UINT64_MAX;
+            ranks[k * TREE_ORDER + i] = count;
+        }
+    }
+
+    build_tree (keys, ranks, nodes, addresses, count,
+                k * (TREE_ORDER + 1) + TREE_ORDER + 1, next);
+}
+
+
+/* Build an index from a sorted array of symbols, into a malloc'd buffer.  The
+ * buffer is cache-line aligned, as a mapped index would be.  */
+static SymbolIndex * build_index (const ElfSymbol * symbols, size_t count)
+{
+    uint64_t strings_size = 0;
+    for (size_t i = 0; i != count; ++i)
+        strings_size += strlen (symbols[i].name) + 1;
 
-        ++it->symbols_count;
+    uint64_t size = index_bytes (count, strings_size);
+    void * buffer;
+    if (posix_memalign (&buffer, 64, size) != 0)
+        return NULL;
+
+    SymbolIndex * x = buffer;
+    memset (x, 0, sizeof (SymbolIndex));
+    memcpy (x->magic, SYMBOL_INDEX_MAGIC, sizeof x->magic);
+    x->version = SYMBOL_INDEX_VERSION;
+    x->count = count;
+    x->strings_size = strings_size;
+    x->size = size;
+    x->nodes = (count + TREE_ORDER - 1) / TREE_ORDER;
+
+    uint64_t * addresses = (uint64_t *) index_addresses (x);
+    uint32_t * sizes = (uint32_t *) index_sizes (x);
+    uint32_t * names = (uint32_t *) index_names (x);
+    char * strings = (char *) index_strings (x);
+    uint32_t offset = 0;
+    for (size_t i = 0; i != count; ++i) {
+        addresses[i] = symbols[i].address;
+        sizes[i] = symbols[i].size;
+        names[i] = offset;
+        size_t length = strlen (symbols[i].name) + 1;
+        memcpy (strings + offset, symbols[i].name, length);
+        offset += length;
     }
 
-    assert (it->symbols_count == wanted);
+    size_t next = 0;
+    build_tree ((uint64_t *) index_tree_keys (x),
+                (uint32_t *) index_tree_ranks (x), x->nodes,
+                addresses, count, 0, &next);
+    assert (next == count);
 
-    /* Sort the symbols by address so we can do a binary search later.  */
-    qsort (it->symbols, it->symbols_count, sizeof (ElfSymbol),
-           compare_elf_symbol);
+    return x;
+}
+
+
+/* The number of keys in a tree node that are <= key.  Keys in a node are
+ * sorted, so this is also the child to descend to.  */
+static inline __attribute__ ((always_inline))
+unsigned node_rank_generic (const uint64_t * node, uint64_t key)
+{
+    unsigned rank = 0;
+    for (int i = 0; i != TREE_ORDER; ++i)
+        rank += node[i] <= key;
+    return rank;
+}
+
+
+/* Search the tree, returning the number of symbols at or before key: the
+ * symbol covering key, if any, is the one before that.  The children of a
+ * node are adjacent, a cache line each, so we prefetch all of them while
+ * comparing the node.  */
+static inline __attribute__ ((always_inline))
+size_t index_search_with (const SymbolIndex * x, uint64_t key,
+                          unsigned (* node_rank) (const uint64_t *, uint64_t))
+{
+    const uint64_t * keys = index_tree_keys (x);
+    const uint32_t * ranks = index_tree_ranks (x);
+    size_t result = x->count;
+    size_t k = 0;
+    while (k < x->nodes) {
+        const uint64_t * node = keys + k * TREE_ORDER;
+        size_t first_child = k * (TREE_ORDER + 1) + 1;
+        if (first_child < x->nodes)
+            for (int i = 0; i <= TREE_ORDER; ++i)
+                __builtin_prefetch (keys + (first_child + i) * TREE_ORDER);
+
+        unsigned i = node_rank (node, key);
+        if (i < TREE_ORDER)
+            result = ranks[k * TREE_ORDER + i];
+        k = first_child + i;
+    }
+
+    return result;
+}
+
+
+static size_t index_search_generic (const SymbolIndex * x, uint64_t key)
+{
+    return index_search_with (x, key, node_rank_generic);
+}
+
+
+#if defined (__x86_64__) || defined (__i386__)
+#include <immintrin.h>
+
+/* AVX2 version of node_rank: the eight keys are two vectors.  The compare is
+ * signed, so flip the sign bits to get an unsigned compare.  */
+static inline __attribute__ ((always_inline, target ("avx2")))
+unsigned node_rank_avx2 (const uint64_t * node, uint64_t key)
+{
+    const __m256i bias = _mm256_set1_epi64x (INT64_MIN);
+    __m256i k = _mm256_xor_si256 (_mm256_set1_epi64x (key), bias);
+    __m256i lo = _mm256_xor_si256 (
+        _mm256_loadu_si256 ((const __m256i *) node), bias);
+    __m256i hi = _mm256_xor_si256 (
+        _mm256_loadu_si256 ((const __m256i *) node + 1), bias);
+    /* Bits are set for keys greater than key.  */
+    unsigned greater = _mm256_movemask_pd (
+        _mm256_castsi256_pd (_mm256_cmpgt_epi64 (lo, k)))
+        | _mm256_movemask_pd (
+            _mm256_castsi256_pd (_mm256_cmpgt_epi64 (hi, k))) << 4;
+    return TREE_ORDER - __builtin_popcount (greater);
+}
+
+
+static __attribute__ ((target ("avx2")))
+size_t index_search_avx2 (const SymbolIndex * x, uint64_t key)
+{
+    return index_search_with (x, key, node_rank_avx2);
+}
+#endif
+
+
+/* Tree search, picking the AVX2 version if the CPU has it.  */
+static size_t index_search (const SymbolIndex * x, uint64_t key)
+{
+#if defined (__x86_64__) || defined (__i386__)
+    static int have_avx2 = -1;
+    if (have_avx2 < 0)
+        have_avx2 = __builtin_cpu_supports ("avx2");
+    if (have_avx2)
+        return index_search_avx2 (x, key);
+#endif
+    return index_search_generic (x, key);
+}
+
+
+static void fill_in_elf_object (ElfObject * it)
+{
+    /* If we're already filled in, or we've already failed, do nothing.  */
+    if (it->index != NULL || it->filename == NULL)
+        return;
+
+    /* A cached index means no ELF parsing at all.  */
+    if (load_cached_index (it))
+        return;
 
 #ifdef DEBUG
-    fprintf (stderr, "Grokked %u symbols out of %u for %s\n",
-             it->symbols_count, symbol_count, it->name);
-/*    for (size_t i = 0; i != it->symbols_count; ++i) */
-/*       fprintf (stderr, "\t%p %5i\t%s\n", */
-/* 	       it->symbols[i].address, */
-/* 	       it->symbols[i].size, */
-/* 	       it->symbols[i].name); */
+    fprintf (stderr, "Loading elf object %s\n", it->name);
 #endif
-    return;
 
-failed:
+    SymbolSource source = { NULL, 0, 0, NULL, NULL, NULL };
+    if (!get_symbols (it, &source)) {
+        it->filename = NULL;
+        return;
+    }
+
+    /* Sort the symbols by address so we can do a binary search later.  */
+    qsort (source.symbols, source.count, sizeof (ElfSymbol),
+           compare_elf_symbol);
+
+    /* Without a full symtab, fill the gaps from the unwind tables.  */
+    if (!source.complete && add_fde_symbols (it, &source))
+        qsort (source.symbols, source.count, sizeof (ElfSymbol),
+               compare_elf_symbol);
+
+    /* The index holds copies of the names, so the ELF files can go.  An
+     * object without symbols gets an empty index, which is cached too, so we
+     * don't go looking again.  */
+    it->index = build_index (source.symbols, source.count);
+    free (source.symbols);
+    if (source.mini_elf != NULL)
+        elf_end (source.mini_elf);
+    free (source.mini_data);
+    free (source.fde_names);
     close_elf (it->elf, it->fd);
     it->elf = NULL;
     it->fd = -1;
-    it->filename = NULL;
+    if (it->index == NULL) {
+        fprintf (stderr, "Malloc symbol index failed in %s\n", it->name);
+        it->filename = NULL;
+        return;
+    }
+
+    save_cached_index (it);
+}
+
+
+/* Release an object's symbol index.  */
+static void free_index (ElfObject * o)
+{
+    if (o->index == NULL)
+        return;
+
+    if (o->index_mapped)
+        munmap ((void *) o->index, o->index->size);
+    else
+        free ((void *) o->index);
+    o->index = NULL;
+}
+
+
+/* Load and unload counts, from dl_iterate_phdr.  */
+typedef struct LoadCounts
+{
+    unsigned long long adds;
+    unsigned long long subs;
+} LoadCounts;
+
+static LoadCounts load_counts;
+
+static int get_load_counts_1 (struct dl_phdr_info * info,
+                              size_t size, void * p)
+{
+    LoadCounts * counts = p;
+    if (size >= offsetof (struct dl_phdr_info, dlpi_subs)
+                + sizeof (info->dlpi_subs)) {
+        counts->adds = info->dlpi_adds;
+        counts->subs = info->dlpi_subs;
+    }
+    return 1;
+}
+
+
+/* Do two entries describe the same loaded object?  The old entry may be for
+   an object that has since been unloaded, so only compare pointers, not what
+   they point to.  */
+static int same_elf_object (const ElfObject * a, const ElfObject * b)
+{
+    return a->address == b->address && a->size == b->size
+        && a->base == b->base && a->name == b->name
+        && a->build_id == b->build_id;
+}
+
+
+/* Create the array of elf objects, or bring it up to date.  The table is
+ * meant to live for the whole process: if nothing has been loaded or unloaded
+ * since the last call, there is nothing to do; otherwise the objects are
+ * listed again, and those still present keep their symbol indexes.  */
+void reflect_symtab_create (void)
+{
+   elf_version (EV_CURRENT);
+
+   LoadCounts counts = { 0, 0 };
+   dl_iterate_phdr (get_load_counts_1, &counts);
+   if (elf_object_array != NULL && counts.adds != 0
+       && counts.adds == load_counts.adds && counts.subs == load_counts.subs)
+      return;
+
+   load_counts = counts;
+
+   ElfObject *  old = elf_object_array;
+   unsigned int old_count = elf_object_count;
+   elf_object_array = NULL;
+   elf_object_count = 0;
+
+   dl_iterate_phdr (build_elf_object_1, NULL);
+
+   /* Sort it so we can look up by binary search.  */
+   qsort (elf_object_array, elf_object_count, sizeof (ElfObject),
+	  compare_elf_object);
+
+   /* Both arrays are sorted, so merge across the symbols of the objects
+      that are still there, and drop the rest.  */
+   unsigned int j = 0;
+   for (unsigned int i = 0; i != elf_object_count; ++i) {
+      ElfObject * it = &elf_object_array[i];
+      while (j != old_count && old[j].address < it->address) {
+         free_index (&old[j]);
+         close_elf (old[j].elf, old[j].fd);
+         ++j;
+      }
+
+      if (j != old_count && same_elf_object (&old[j], it)) {
+         it->filename = old[j].filename;
+         it->delta = old[j].delta;
+         it->index = old[j].index;
+         it->index_mapped = old[j].index_mapped;
+         old[j].index = NULL;
+         ++j;
+      }
+   }
+
+   for (; j != old_count; ++j) {
+      free_index (&old[j]);
+      close_elf (old[j].elf, old[j].fd);
+   }
+
+   free (old);
 }
 
 
@@ -430,7 +1408,7 @@ void reflect_symtab_destroy (void)
     for (unsigned int i = 0; i != elf_object_count; ++i) {
         ElfObject * o = &elf_object_array[i];
 
-        free (o->symbols);
+        free_index (o);
         close_elf (o->elf, o->fd);
     }
 
@@ -438,26 +1416,18 @@ void reflect_symtab_destroy (void)
     free (elf_object_array);
     elf_object_array = NULL;
     elf_object_count = 0;
+    load_counts.adds = 0;
+    load_counts.subs = 0;
 }
 
 
 /* Lookup object symbol and offset for an address.  object and/or
  * symbol may be set to NULL.  */
-void reflect_symtab_lookup (const char ** object,
-			    const char ** symbol,
-			    size_t *      offset,
-			    const void *  address)
+/* The object containing an address, or NULL.  */
+static ElfObject * find_elf_object (const void * address)
 {
-    *object = NULL;
-    *symbol = NULL;
-    *offset = (size_t) address;
-
-    if (elf_object_count == 0) {
-#ifdef DEBUG
-        fprintf (stderr, "Lookup : no objects\n");
-#endif
-        return;			/* No elf objects...  */
-    }
+    if (elf_object_count == 0)
+        return NULL;		/* No elf objects...  */
 
     /* Binary search for the object.  */
     ElfObject * o = elf_object_array;
@@ -470,7 +1440,24 @@ void reflect_symtab_lookup (const char ** object,
         else
             range /= 2;
 
-    if ((size_t) (((char *) address) - ((char *) o->address)) > o->size) {
+    if ((size_t) (((char *) address) - ((char *) o->address)) > o->size)
+        return NULL;		/* Not found.  */
+
+    return o;
+}
+
+
+void reflect_symtab_lookup (const char ** object,
+			    const char ** symbol,
+			    size_t *      offset,
+			    const void *  address)
+{
+    *object = NULL;
+    *symbol = NULL;
+    *offset = (size_t) address;
+
+    ElfObject * o = find_elf_object (address);
+    if (o == NULL) {
 #ifdef DEBUG
         fprintf (stderr, "Lookup : object not found\n");
 #endif
@@ -483,33 +1470,274 @@ void reflect_symtab_lookup (const char ** object,
     *offset = ((char *) address) - ((char *) o->address);
 
     /* Now try for the symbol.  */
-    if (o->symbols_count == 0) {
+    const SymbolIndex * x = o->index;
+    if (x == NULL || x->count == 0) {
 #ifdef DEBUG
         fprintf (stderr, "Lookup : no symbols\n");
 #endif
         return;
     }
 
-    ElfSymbol * s = o->symbols;
-    range = o->symbols_count;
-    while (range > 1)
-        if (s[range / 2].address <= address) {
-            s += range / 2;
-            range -= range / 2;
-        }
-        else
-            range /= 2;
+    uint64_t key = (uintptr_t) address - o->base;
+    const uint64_t * addresses = index_addresses (x);
+    size_t s = index_search (x, key);
+    if (s == 0)
+        return;                 /* Before the first symbol.  */
+    --s;
 
-    if ((size_t) (((char *) address) - ((char *) s->address)) > s->size) {
+    if (key - addresses[s] > index_sizes (x)[s]) {
 #ifdef DEBUG
-        fprintf (stderr, "%p: %s %p %i\n", address, s->name, s->address, s->size);
-//        fprintf (stderr, "Lookup : out of range\n");
+        fprintf (stderr, "%p: %s %#llx %u\n", address,
+                 index_strings (x) + index_names (x)[s],
+                 (unsigned long long) addresses[s], index_sizes (x)[s]);
 #endif
         return;
     }
 
-    *symbol = s->name;
-    *offset = ((char *) address) - ((char *) s->address);
+    *symbol = index_strings (x) + index_names (x)[s];
+    *offset = key - addresses[s];
+}
+
+
+/* Retired objects.
+ *
+ * An object that has been unloaded is kept, with its symbols, on a list
+ * ordered by the module generation at which it went.  It covers samples
+ * taken at earlier generations.  Only the last RETIRED_OBJECTS are kept;
+ * addresses in older ones are reported as unknown rather than as whatever is
+ * there now.  The list is shared with the threads that unload objects, so it
+ * is protected by a mutex.  */
+struct reflect_symtab_capture
+{
+    ElfObject                       object;
+    unsigned long                   generation;
+    struct reflect_symtab_capture * next;
+    /* Copy of the build-id, which goes away with the object.  */
+    unsigned char                   build_id[64];
+};
+
+#define RETIRED_OBJECTS 64
+
+static reflect_symtab_capture * retired_objects;
+static size_t retired_count;
+/* The generation of the last object dropped from the list, or 0.  */
+static unsigned long retired_dropped;
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* dl_iterate_phdr callback finding the object containing an address.  */
+static int find_elf_object_1 (struct dl_phdr_info * info,
+                              size_t size, void * p)
+{
+    ElfObject * it = p;
+    const char * address = it->address;
+
+    init_elf_object (it, info);
+    if ((size_t) (address - (const char *) it->address) < it->size)
+        return 1;
+
+    it->address = address;
+    return 0;
+}
+
+
+reflect_symtab_capture * reflect_symtab_capture_object (const void * address)
+{
+    reflect_symtab_capture * capture = malloc (sizeof *capture);
+    if (capture == NULL)
+        return NULL;
+
+    capture->object.address = address;
+    if (dl_iterate_phdr (find_elf_object_1, &capture->object) == 0) {
+        free (capture);
+        return NULL;
+    }
+
+    /* The link map strings and the build-id go away with the object.  The
+       symbols are only loaded if it really does, from the file or the cache;
+       so the unwind tables, which are only mapped, cannot be used.  */
+    ElfObject * it = &capture->object;
+    it->name = strdup (it->name);
+    it->filename = it->filename ? strdup (it->filename) : NULL;
+    if (it->name == NULL) {
+        free ((char *) it->filename);
+        free (capture);
+        return NULL;
+    }
+
+    if (it->build_id != NULL && it->build_id_size <= sizeof capture->build_id) {
+        memcpy (capture->build_id, it->build_id, it->build_id_size);
+        it->build_id = capture->build_id;
+    }
+    else {
+        it->build_id = NULL;
+        it->build_id_size = 0;
+    }
+    it->eh_frame_hdr = NULL;
+
+    return capture;
+}
+
+
+int reflect_symtab_retire (reflect_symtab_capture * capture,
+                           unsigned long            generation,
+                           const void **            address,
+                           size_t *                 size)
+{
+    if (capture == NULL)
+        return 0;
+
+    *address = capture->object.address;
+    *size = capture->object.size;
+
+    elf_version (EV_CURRENT);
+    fill_in_elf_object (&capture->object);
+    capture->generation = generation;
+
+    pthread_mutex_lock (&retired_mutex);
+    reflect_symtab_capture ** p = &retired_objects;
+    while (*p != NULL && (*p)->generation < generation)
+        p = &(*p)->next;
+    capture->next = *p;
+    *p = capture;
+
+    /* Drop the oldest, which is first.  */
+    reflect_symtab_capture * dropped = NULL;
+    if (++retired_count > RETIRED_OBJECTS) {
+        dropped = retired_objects;
+        retired_objects = dropped->next;
+        retired_dropped = dropped->generation;
+        --retired_count;
+    }
+    pthread_mutex_unlock (&retired_mutex);
+
+    reflect_symtab_release (dropped);
+    return 1;
+}
+
+
+void reflect_symtab_release (reflect_symtab_capture * capture)
+{
+    if (capture == NULL)
+        return;
+
+    free_index (&capture->object);
+    free ((char *) capture->object.name);
+    free ((char *) capture->object.filename);
+    free (capture);
+}
+
+
+/* Look up an address in a single object.  */
+static void lookup_in_object (reflect_symtab_result * r, const ElfObject * o,
+                              const void * address)
+{
+    r->object = o->name;
+    r->symbol = NULL;
+    r->offset = ((char *) address) - ((char *) o->address);
+
+    const SymbolIndex * x = o->index;
+    if (x == NULL || x->count == 0)
+        return;
+
+    uint64_t key = (uintptr_t) address - o->base;
+    size_t s = index_search (x, key);
+    if (s == 0 || key - index_addresses (x)[s - 1] > index_sizes (x)[s - 1])
+        return;
+
+    r->symbol = index_strings (x) + index_names (x)[s - 1];
+    r->offset = key - index_addresses (x)[s - 1];
+}
+
+
+int reflect_symtab_lookup_retired (reflect_symtab_result * result,
+                                   const void *            address,
+                                   unsigned long           generation)
+{
+    int found = 0;
+
+    pthread_mutex_lock (&retired_mutex);
+    /* The list is in generation order, so the first match is the object
+       that was loaded at the time.  */
+    for (const reflect_symtab_capture * c = retired_objects; c; c = c->next) {
+        const ElfObject * o = &c->object;
+        if (c->generation <= generation
+            || (size_t) ((const char *) address - (const char *) o->address)
+               > o->size)
+            continue;
+
+        lookup_in_object (result, o, address);
+        found = 1;
+        break;
+    }
+
+    /* The object may have been dropped.  */
+    if (!found && generation < retired_dropped) {
+        result->object = NULL;
+        result->symbol = NULL;
+        result->offset = 0;
+        found = 1;
+    }
+    pthread_mutex_unlock (&retired_mutex);
+
+    return found;
+}
+
+
+/* Batch lookup.  Sorting the batch to merge it with each object's symbols
+ * costs more than it saves now that single lookups search a tree, so each
+ * address is looked up on its own.  But addresses from the same object tend
+ * to come together, so the last object is tried before searching for one,
+ * and a repeated address just copies the last result.  */
+void reflect_symtab_lookup_batch (const void * const *    addresses,
+				  size_t                  count,
+				  reflect_symtab_result * results)
+{
+    ElfObject * o = NULL;
+    for (size_t i = 0; i != count; ++i) {
+        reflect_symtab_result * r = &results[i];
+        const char * address = addresses[i];
+
+        if (i != 0 && address == addresses[i - 1]) {
+            *r = results[i - 1];
+            continue;
+        }
+
+        if (o == NULL
+            || (size_t) (address - (const char *) o->address) > o->size) {
+            o = find_elf_object (address);
+            if (o == NULL) {
+                r->object = NULL;
+                r->symbol = NULL;
+                r->offset = (size_t) address;
+                continue;
+            }
+            fill_in_elf_object (o);
+        }
+
+        lookup_in_object (r, o, address);
+    }
+}
+
+
+void reflect_symtab_print (FILE *                        f,
+                           const reflect_symtab_result * result,
+                           int                           verbose)
+{
+    const char * object = result->object;
+    const char * symbol = result->symbol;
+    size_t       offset = result->offset;
+
+    if (verbose && symbol)
+        fprintf (f, "\t%s+%zi\t(%s)\n", symbol, offset, object);
+    else if (verbose && object)
+        fprintf (f, "\t%s+%#zx\n", object, offset);
+    else if (symbol)
+        fprintf (f, "\t%s\t(%s)\n", symbol, object);
+    else if (object)
+        fprintf (f, "\t%s\n", object);
+    else
+        fprintf (f, "\t%p\n", (void *) offset);
 }
 
 
@@ -524,24 +1752,15 @@ char * reflect_symtab_format (const void * const * addresses,
     if (f == NULL)
         return NULL;
 
-    for (size_t i = 0; i != count && addresses[i] != NULL; ++i) {
-        const char * object;
-        const char * symbol;
-        size_t       offset;
-
-        reflect_symtab_lookup (&object, &symbol, &offset, addresses[i]);
-
-        if (verbose && symbol)
-            fprintf (f, "\t%s+%zi\t(%s)\n", symbol, offset, object);
-        else if (verbose && object)
-            fprintf (f, "\t%s+%#zx\n", object, offset);
-        else if (symbol)
-            fprintf (f, "\t%s\t(%s)\n", symbol, object);
-        else if (object)
-            fprintf (f, "\t%s\n", object);
-        else
-            fprintf (f, "\t%p\n", (void *) offset);
-    }
+    size_t n = 0;
+    while (n != count && addresses[n] != NULL)
+        ++n;
+
+    reflect_symtab_result results [n > 0 ? n : 1];
+    reflect_symtab_lookup_batch (addresses, n, results);
+
+    for (size_t i = 0; i != n; ++i)
+        reflect_symtab_print (f, &results[i], verbose);
 
     if (fclose (f) != 0)
         return NULL;
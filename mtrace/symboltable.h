@@ -1,13 +1,16 @@
 #ifndef SYMBOL_TABLE_H_
 #define SYMBOL_TABLE_H_
 
+#include <stdio.h>
 #include <stdlib.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/* Create the symbol table data structures.  */
+/* Create the symbol table data structures, or bring them up to date with
+   the objects currently loaded.  Symbols already read for objects that are
+   still loaded are kept, so calling this before every report is cheap.  */
 void reflect_symtab_create (void);
 /* Destroy the symbol table data structures.  */
 void reflect_symtab_destroy (void);
@@ -19,6 +22,42 @@ void reflect_symtab_lookup (const char ** object,
 			    const char ** symbol,
 			    size_t *      offset,
 			    const void *  address);
+/* The result of looking up one address; fields as for
+   reflect_symtab_lookup.  */
+typedef struct reflect_symtab_result {
+  const char * object;
+  const char * symbol;
+  size_t       offset;
+} reflect_symtab_result;
+/* Look up count addresses at once, setting results[i] for addresses[i].
+   Cheaper than separate lookups when neighbouring addresses are in the same
+   object, or the same.  */
+void reflect_symtab_lookup_batch (const void * const *    addresses,
+				  size_t                  count,
+				  reflect_symtab_result * results);
+/* Unloaded objects.  Before unloading an object, note it by passing any
+   address inside it to reflect_symtab_capture_object, which is cheap.  If the
+   object really went away, hand the capture to reflect_symtab_retire with
+   the module generation that starts after the unload, which loads its
+   symbols and sets the address range it covered; otherwise free it with
+   reflect_symtab_release.  reflect_symtab_lookup_retired then resolves an
+   address sampled at an earlier generation against the object loaded at the
+   time, returning non-zero if there was one.  */
+typedef struct reflect_symtab_capture reflect_symtab_capture;
+reflect_symtab_capture * reflect_symtab_capture_object (const void * address);
+int reflect_symtab_retire (reflect_symtab_capture * capture,
+			   unsigned long            generation,
+			   const void **            address,
+			   size_t *                 size);
+void reflect_symtab_release (reflect_symtab_capture * capture);
+int reflect_symtab_lookup_retired (reflect_symtab_result * result,
+				   const void *            address,
+				   unsigned long           generation);
+/* Print one looked up address as a line of a stack trace.  With verbose,
+   include the offset.  */
+void reflect_symtab_print (FILE *                        f,
+			   const reflect_symtab_result * result,
+			   int                           verbose);
 /* Format a list of addresses, one per line, into a malloc'd buffer.  */
 char * reflect_symtab_format (const void * const * addresses,
 			      size_t               count,
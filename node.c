@@ -30,11 +30,12 @@ static inline int check (int s, const char * w)
 
 static scg_node_t * scg_put_node (scg_node_t * current,
                                   uintptr_t address,
+                                  unsigned long generation,
                                   scg_node_t ** restrict new_node)
 {
     /* Generate hash key. */
     unsigned long hash = 5 * (unsigned long) current;
-    hash += (unsigned long) address;
+    hash += (unsigned long) address + 3 * generation;
     hash *= GOLDEN_PRIME;
 
     /* Reduce to table size. */
@@ -48,7 +49,8 @@ static scg_node_t * scg_put_node (scg_node_t * current,
 
         if (node != NULL) {
             /* See if the existing node is good enough. */
-            if (node->address == address && node->next == current)
+            if (node->address == address && node->next == current
+                && node->generation == generation)
                 return node;
 
             /* Try next node in hash list. */
@@ -61,7 +63,9 @@ static scg_node_t * scg_put_node (scg_node_t * current,
 
         (*new_node)->address = address;
         (*new_node)->next = current;
-        (*new_node)->counter = 0;
+        (*new_node)->generation = generation;
+        memset ((void *) (*new_node)->counters, 0,
+                sizeof ((*new_node)->counters));
 
         /* Insert it atomically. */
         if (!__atomic_compare_exchange_n(pnode, &node, *new_node, true,
@@ -75,28 +79,42 @@ static scg_node_t * scg_put_node (scg_node_t * current,
 }
 
 
-static void scg_signal_handler (int signal, siginfo_t * info, void * p)
+__attribute__ ((noinline))
+scg_node_t * scg_stack_node (int skip, scg_node_t ** spare)
 {
-    static __thread scg_node_t * new_node = NULL;
     scg_node_t * node = NULL;
 
-    /* Setup the stack frame data.  Skip me and __restore_rt.  */
+    /* Setup the stack frame data, and skip the frames we don't want.  */
     unw_context_t context;
     unw_cursor_t cursor;
     if (unw_getcontext (&context) < 0
-        || unw_init_local (&cursor, &context) < 0
-        || unw_step(&cursor) <= 0 || unw_step(&cursor) <= 0)
-        return;
+        || unw_init_local (&cursor, &context) < 0)
+        return NULL;
+    for (int i = 0; i != skip; ++i)
+        if (unw_step (&cursor) <= 0)
+            return NULL;
 
     do {
         unw_word_t ip = 0;
         if (unw_get_reg (&cursor, UNW_TDEP_IP, &ip) < 0 || ip == 0)
             break;
-        node = scg_put_node (node, ip, &new_node);
+        node = scg_put_node (node, ip, scg_module_generation_of (ip),
+                             spare);
     }
     while (unw_step (&cursor) > 0);
 
-    __atomic_add_fetch (&node->counter, 1, __ATOMIC_RELAXED);
+    return node;
+}
+
+
+static void scg_signal_handler (int signal, siginfo_t * info, void * p)
+{
+    static __thread scg_node_t * new_node = NULL;
+
+    /* Skip scg_stack_node, me and __restore_rt.  */
+    scg_node_t * node = scg_stack_node (3, &new_node);
+    if (node != NULL)
+        __atomic_add_fetch (&node->counters[SCG_SAMPLES], 1, __ATOMIC_RELAXED);
 }
 
 
@@ -118,6 +136,8 @@ void scg_thread_initialize (void)
     timer.it_value   .tv_usec = 2000;
 
     setitimer (ITIMER_PROF, &timer, NULL);
+
+    scg_events_thread_initialize();
 }
 
 static void user1_handler (int signal, siginfo_t * info, void * p)
@@ -150,5 +170,8 @@ void scg_initialize (void)
 
     is_initialized = 1;
 
+    scg_heap_initialize();
+    scg_events_initialize();
+    scg_locks_initialize();
     scg_thread_initialize();
 }
@@ -14,12 +14,33 @@
 extern "C" {
 #endif
 
+/* What the nodes count.  Each counter is the total for the stacks ending at
+ * the node.  */
+enum scg_counter {
+    SCG_SAMPLES,                /* CPU profile samples.  */
+    SCG_ALLOC_BYTES,            /* Bytes allocated, in heap mode.  */
+    SCG_LIVE_BYTES,             /* Bytes allocated and not yet freed (so may
+                                 * wrap below zero on one node).  */
+    SCG_PAGE_FAULTS,            /* Page faults, with SCG_FAULTS.  */
+    SCG_CONTEXT_SWITCHES,       /* Context switches, with SCG_SWITCHES.  */
+    SCG_LOCK_WAIT,              /* Nanoseconds waiting for contended mutexes
+                                 * and rwlocks, with SCG_LOCKS.  */
+    SCG_COND_WAIT,              /* Nanoseconds waiting on condition variables,
+                                 * with SCG_LOCKS.  */
+    SCG_COUNTERS
+};
+
 typedef struct scg_node_t {
     uintptr_t           address;        /* Return address from stack frame. */
     struct scg_node_t * next;           /* Next on stack frame. */
 
-    /* We use non-locking operations to modify counter; hence it is volatile. */
-    volatile unsigned long counter;
+    /* Generation of the last unload covering the address when it was
+     * sampled; see scg_module_generation_of.  */
+    unsigned long       generation;
+
+    /* We use non-locking operations to modify counters; hence they are
+     * volatile. */
+    volatile unsigned long counters[SCG_COUNTERS];
 
     /* Link pointer for hash table.  It is volatile because we use non-locking
      * operations to extend that hash table.  */
@@ -35,6 +56,64 @@ extern scg_node_t * volatile scg_node_hash[SCG_NODE_HASH_SIZE];
 
 scg_node_t * scg_allocate_node();
 
+/* Add the current stack to the hash table, skipping the innermost 'skip'
+ * frames (counting this function's own).  Returns the node for the outermost
+ * frame, which stands for the whole stack, or NULL if there are no frames.
+ * *spare keeps a node allocated but not used, for next time; callers that may
+ * interrupt each other need their own.  */
+scg_node_t * scg_stack_node (int skip, scg_node_t ** spare);
+
+/* Heap mode: sample allocations into the hash table, every scg_heap_interval
+ * bytes.  Zero if heap mode is off.  See heap.c.  */
+extern unsigned long scg_heap_interval;
+
+void scg_heap_initialize (void);
+
+/* Stop and restart sampling this thread's allocations.  */
+void scg_heap_pause (void);
+void scg_heap_resume (void);
+
+/* Software events: sample every scg_fault_period page faults and every
+ * scg_switch_period context switches into the hash table.  Zero if off.  See
+ * events.c.  */
+extern unsigned long scg_fault_period;
+extern unsigned long scg_switch_period;
+
+void scg_events_initialize (void);
+
+/* Open this thread's events.  */
+void scg_events_thread_initialize (void);
+
+/* Lock contention: waits for locks of at least scg_lock_threshold
+ * nanoseconds are added to the hash table, if scg_locks.  See locks.c.  */
+extern int           scg_locks;
+extern unsigned long scg_lock_threshold;
+
+void scg_locks_initialize (void);
+
+/* The waits at each call site, for each lock.  */
+typedef struct scg_lock_site_t {
+    scg_node_t *  node;                 /* The stack; NULL if empty.  */
+    const void *  lock;
+    unsigned long waits;
+    unsigned long nanoseconds;
+} scg_lock_site_t;
+
+#define SCG_LOCK_SITES_ORDER 12
+#define SCG_LOCK_SITES (1 << SCG_LOCK_SITES_ORDER)
+
+extern scg_lock_site_t scg_lock_sites[SCG_LOCK_SITES];
+
+/* The module generation counts the shared objects unloaded so far.  */
+extern volatile unsigned long scg_module_generation;
+
+/* The generation at which the last object covering an address was unloaded,
+ * or 0 if none has been.  Nodes are tagged with it, so that addresses in an
+ * object that has since been unloaded can be attributed to that object, not
+ * to whatever is mapped there now; while nothing is unloaded from under an
+ * address, its nodes stay the same.  Safe in signal handlers.  */
+unsigned long scg_module_generation_of (uintptr_t address);
+
 #ifdef __cplusplus
 }
 #endif
@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <map>
 #include <memory>
 #include <string>
@@ -26,13 +27,17 @@ struct scg_function_record {
     scg_function_record() :
         address (0),
         call_count (0),
-        terminal_count (0)
+        terminal_count (0),
+        self(),
+        total()
         { }
 
     scg_function_record (const std::string & n, uintptr_t a) :
         name (n),
         address (a),
-        call_count (0)
+        call_count (0),
+        self(),
+        total()
         { }
 
     std::string name;
@@ -50,56 +55,106 @@ struct scg_function_record {
     // times in the stack.
     std::vector <int> call_count_breakdown;
 
+    // The node counters (scg_counter) summed over the stacks ending at us, and
+    // over the stacks we occur on at least once.
+    unsigned long  self[SCG_COUNTERS];
+    unsigned long  total[SCG_COUNTERS];
+
     // Print to out_file.
     void output (FILE *        out_file,
                  unsigned long total_samples) const;
 };
 
+// The waits for one lock from one function.
+struct scg_lock_record {
+    unsigned long  waits;
+    unsigned long  nanoseconds;
+};
+
 struct scg_database {
     scg_database() :
         spontaneous ("<spontaneous>", 0),
-        total_samples (0)
+        totals()
         { }
 
-    // Function records indexed by base address.
-    std::map <uintptr_t, scg_function_record> records;
+    // Function records indexed by base address and name.  The name
+    // distinguishes functions in unloaded objects from whatever now occupies
+    // the same address.
+    std::map <std::pair <uintptr_t, std::string>, scg_function_record> records;
+
+    // Function records indexed by return address and node generation.
+    std::map <std::pair <uintptr_t, unsigned long>, scg_function_record *>
+        canonicalisers;
+
+    // Convert a return address, tagged with a node generation, to a record.
+    scg_function_record & address_to_record (uintptr_t     address,
+                                             unsigned long generation);
 
-    // Function records indexed by return address.
-    std::map <uintptr_t, scg_function_record *> canonicalisers;
+    // Find or create the record for a looked-up return address.
+    scg_function_record & symbol_to_record (uintptr_t    address,
+                                            const char * name,
+                                            size_t       offset);
 
-    // Convert a return address to a record.
-    scg_function_record & address_to_record (uintptr_t address);
+    // Look up every address in the hash table in one batch, filling in
+    // canonicalisers.
+    void symbolize (scg_node_t * volatile * hash_table,
+                    size_t                  hash_table_size);
 
     // Add node into database.
-    void process_node (const scg_node_t & node,
-                       unsigned long      counter);
+    void process_node (const scg_node_t & node);
 
     // Add entire hash table.
     void build_from (scg_node_t * volatile * hash_table,
                      size_t                  hash_table_size);
 
+    // Add the lock waits, after the hash table.
+    void build_locks (const scg_lock_site_t * sites, size_t sites_size);
+
+    // Lock waits by waiting function and lock address.
+    typedef std::map <std::pair <const scg_function_record *, uintptr_t>,
+                      scg_lock_record> lock_map;
+    lock_map              locks;
+
     // The '<spontaneous>' record.
     scg_function_record   spontaneous;
 
-    // Total number of samples in database.
-    unsigned long         total_samples;
+    // Totals of each node counter in database.
+    unsigned long         totals[SCG_COUNTERS];
 
     // Print to stderr.
     void output (FILE * out_file) const;
+
+    // Print the lock waits.
+    void output_locks (FILE * out_file) const;
 };
 
-scg_function_record & scg_database::address_to_record (uintptr_t address)
+scg_function_record & scg_database::address_to_record (
+    uintptr_t     address,
+    unsigned long generation)
 {
-    auto i = canonicalisers.find (address);
+    auto key = std::make_pair (address, generation);
+    auto i = canonicalisers.find (key);
     if (i != canonicalisers.end())
         return *i->second;
 
-    const char * object;
-    const char * name;
-    size_t       offset;
-    char         fake_name[20];
+    reflect_symtab_result r;
+    if (generation == scg_module_generation_of (address)
+        || !reflect_symtab_lookup_retired (&r, (const void *) address,
+                                           generation))
+        reflect_symtab_lookup (&r.object, &r.symbol, &r.offset,
+                               (const void *) address);
+
+    scg_function_record & result = symbol_to_record (address, r.symbol,
+                                                     r.offset);
+    canonicalisers[key] = &result;
+    return result;
+}
 
-    reflect_symtab_lookup (&object, &name, &offset, (const void *) address);
+scg_function_record & scg_database::symbol_to_record (uintptr_t    address,
+                                                      const char * name,
+                                                      size_t       offset)
+{
+    char         fake_name[20];
 
     if (name == NULL) {
         // The address was not found, so we fake it.
@@ -110,7 +165,8 @@ scg_function_record & scg_database::address_to_record (uintptr_t address)
 
     address = address - offset;         // Base address.
 
-    scg_function_record & result = records[address];
+    scg_function_record & result = records[std::make_pair (address,
+                                                          std::string (name))];
 
     if (result.address == 0) {
         /* This is a new record; initialise it. */
@@ -123,34 +179,93 @@ scg_function_record & scg_database::address_to_record (uintptr_t address)
     return result;
 }
 
-void scg_database::process_node (const scg_node_t & node,
-                                 unsigned long      counter)
+void scg_database::symbolize (scg_node_t * volatile * hash_table,
+                              size_t                  hash_table_size)
 {
+    std::vector <std::pair <uintptr_t, unsigned long> > keys;
+    for (size_t i = 0; i != hash_table_size; ++i)
+        for (const scg_node_t * node = hash_table[i];
+             node; node = node->hash_link)
+            keys.push_back (std::make_pair (node->address, node->generation));
+
+    std::sort (keys.begin(), keys.end());
+    keys.erase (std::unique (keys.begin(), keys.end()), keys.end());
+
+    // Addresses where something was unloaded since they were sampled may
+    // belong to unloaded objects; everything else goes into the batch.
+    std::vector <const void *> addresses;
+    std::vector <size_t>       batched;
+    for (size_t i = 0; i != keys.size(); ++i) {
+        reflect_symtab_result r;
+        if (keys[i].second != scg_module_generation_of (keys[i].first)
+            && reflect_symtab_lookup_retired (&r, (const void *) keys[i].first,
+                                              keys[i].second)) {
+            canonicalisers[keys[i]] = &symbol_to_record (
+                keys[i].first, r.symbol, r.offset);
+            continue;
+        }
+
+        addresses.push_back ((const void *) keys[i].first);
+        batched.push_back (i);
+    }
+
+    std::vector <reflect_symtab_result> results (addresses.size());
+    reflect_symtab_lookup_batch (addresses.data(), addresses.size(),
+                                 results.data());
+
+    for (size_t i = 0; i != addresses.size(); ++i) {
+        const auto & key = keys[batched[i]];
+        canonicalisers[key] = &symbol_to_record (
+            key.first, results[i].symbol, results[i].offset);
+    }
+}
+
+void scg_database::process_node (const scg_node_t & node)
+{
+    unsigned long counters[SCG_COUNTERS];
+    for (int c = 0; c != SCG_COUNTERS; ++c)
+        counters[c] = node.counters[c];
+    unsigned long counter = counters[SCG_SAMPLES];
 //   fprintf (stderr, "Node counter is %li\n", counter);
 
     // Walk through the stack adding in the caller and callee counts.  We have a
-    // fake '<spontaneous>' entry for the 'caller' of the stack top.
+    // fake '<spontaneous>' entry for the 'caller' of the stack top.  Stacks
+    // with only heap samples add no call graph edges.
     record_counts  occur_counts;
     scg_function_record * caller = &spontaneous;
     for (const scg_node_t * i = &node; i; i = i->next) {
-        scg_function_record & callee = address_to_record (i->address);
+        scg_function_record & callee = address_to_record (i->address,
+                                                          i->generation);
 //      fprintf (stderr, "\t%s\n", callee.name.c_str());
-        callee. caller_counts[ caller] += counter;
-        caller->callee_counts[&callee] += counter;
+        if (counter != 0) {
+            callee. caller_counts[ caller] += counter;
+            caller->callee_counts[&callee] += counter;
+        }
 
         ++occur_counts[&callee];
         caller = &callee;
     }
     caller->terminal_count += counter;
+    for (int c = 0; c != SCG_COUNTERS; ++c)
+        caller->self[c] += counters[c];
 
     // Now increase all the record_counts.
     for (auto & i : occur_counts) {
+        for (int c = 0; c != SCG_COUNTERS; ++c)
+            i.first->total[c] += counters[c];
+
+        if (counter == 0)
+            continue;
+
         i.first->call_count += counter;
         if (i.first->call_count_breakdown.size() < i.second)
             i.first->call_count_breakdown.resize (i.second);
 
         i.first->call_count_breakdown[i.second - 1] += counter;
     }
+
+    for (int c = 0; c != SCG_COUNTERS; ++c)
+        totals[c] += counters[c];
 }
 
 void scg_database::build_from (scg_node_t * volatile * hash_table,
@@ -159,29 +274,110 @@ void scg_database::build_from (scg_node_t * volatile * hash_table,
     for (size_t i = 0; i != hash_table_size; ++i) {
         for (const scg_node_t * node = hash_table[i];
              node; node = node->hash_link) {
-            unsigned long counter = node->counter;
+            bool counted = false;
+            for (int c = 0; c != SCG_COUNTERS; ++c)
+                counted |= node->counters[c] != 0;
 
-            if (counter != 0) {
-                process_node (*node, counter);
-                total_samples += counter;
-            }
+            if (counted)
+                process_node (*node);
         }
     }
 }
 
+void scg_database::build_locks (const scg_lock_site_t * sites,
+                                size_t                  sites_size)
+{
+    for (size_t i = 0; i != sites_size; ++i) {
+        if (sites[i].node == NULL)
+            continue;
+
+        // The node is the outermost frame; find the function that waited.
+        // Stacks differing further out are merged.
+        const scg_node_t * node = sites[i].node;
+        while (node->next != NULL)
+            node = node->next;
+        const scg_function_record & record = address_to_record (
+            node->address, node->generation);
+        scg_lock_record & lock = locks[std::make_pair (
+                &record, (uintptr_t) sites[i].lock)];
+        lock.waits += sites[i].waits;
+        lock.nanoseconds += sites[i].nanoseconds;
+    }
+}
+
+// The most lock sites we print.
+static const size_t LOCKS_SHOWN = 50;
+
+void scg_database::output_locks (FILE * out_file) const
+{
+    std::multimap <unsigned long, const lock_map::value_type *,
+                   std::greater <unsigned long> > sorted;
+    for (const auto & i : locks)
+        sorted.insert (std::make_pair (i.second.nanoseconds, &i));
+
+    fprintf (out_file, "Lock waits by function and lock, longest first:\n");
+    size_t shown = 0;
+    for (const auto & i : sorted) {
+        if (shown++ == LOCKS_SHOWN)
+            break;
+
+        // Static locks have names; others are just addresses.
+        const void * lock = (const void *) i.second->first.second;
+        const char * object;
+        const char * symbol;
+        size_t       offset;
+        char         name[64];
+        reflect_symtab_lookup (&object, &symbol, &offset, lock);
+        if (symbol == NULL)
+            snprintf (name, sizeof name, "%p", lock);
+        else if (offset == 0)
+            snprintf (name, sizeof name, "%s", symbol);
+        else
+            snprintf (name, sizeof name, "%s+%#zx", symbol, offset);
+
+        fprintf (out_file, "%14.3f ms %8lu waits  on %-24s in %s\n",
+                 i.second->second.nanoseconds * 1e-6, i.second->second.waits,
+                 name, i.second->first.first->name.c_str());
+    }
+}
+
 void scg_database::output (FILE * out_file) const
 {
-    std::multimap <int, const scg_function_record *, std::greater<int> >
+    // By samples, then by bytes allocated.
+    typedef std::pair <int, unsigned long> key;
+    std::multimap <key, const scg_function_record *, std::greater<key> >
         sorted;
 
     for (auto & i : records)
-        sorted.insert (std::make_pair (i.second.call_count, &i.second));
+        sorted.insert (std::make_pair (
+                           key (i.second.call_count,
+                                i.second.total[SCG_ALLOC_BYTES]),
+                           &i.second));
 
     fprintf (out_file, "Profile for %s with %lu samples.\n",
-             program_invocation_short_name, total_samples);
+             program_invocation_short_name, totals[SCG_SAMPLES]);
+    if (scg_heap_interval != 0)
+        fprintf (out_file, "Heap sampled every %lu bytes: %lu bytes allocated,"
+                 " %li live.\n", scg_heap_interval, totals[SCG_ALLOC_BYTES],
+                 (long) totals[SCG_LIVE_BYTES]);
+    if (scg_fault_period != 0)
+        fprintf (out_file, "Page faults sampled every %lu: %lu faults.\n",
+                 scg_fault_period, totals[SCG_PAGE_FAULTS]);
+    if (scg_switch_period != 0)
+        fprintf (out_file, "Context switches sampled every %lu: %lu switches."
+                 "\n", scg_switch_period, totals[SCG_CONTEXT_SWITCHES]);
+    if (scg_locks)
+        fprintf (out_file, "Lock waits of %lu ns or more: %.3f ms on locks,"
+                 " %.3f ms on condition variables.\n", scg_lock_threshold,
+                 totals[SCG_LOCK_WAIT] * 1e-6, totals[SCG_COND_WAIT] * 1e-6);
 
     for (const auto & i : sorted)
-        i.second->output (out_file, total_samples);
+        i.second->output (out_file, totals[SCG_SAMPLES]);
+
+    if (scg_locks) {
+        fprintf (out_file, "-------------------------------------------------------------------------------\n");
+        output_locks (out_file);
+    }
 }
 
 typedef std::multimap <int, scg_function_record *> sorted_counts;
@@ -222,6 +418,26 @@ void scg_function_record::output (FILE *        out_file,
                  call_count * 1e2 / total_samples);
     }
 
+    /* Output our bytes allocated and live, if any. */
+    if (scg_heap_interval != 0)
+        fprintf (out_file, "\t\theap %lu/%lu bytes allocated, %li/%li live\n",
+                 self[SCG_ALLOC_BYTES], total[SCG_ALLOC_BYTES],
+                 (long) self[SCG_LIVE_BYTES], (long) total[SCG_LIVE_BYTES]);
+
+    /* And our page faults and context switches.  */
+    if (scg_fault_period != 0)
+        fprintf (out_file, "\t\tfaults %lu/%lu\n",
+                 self[SCG_PAGE_FAULTS], total[SCG_PAGE_FAULTS]);
+    if (scg_switch_period != 0)
+        fprintf (out_file, "\t\tswitches %lu/%lu\n",
+                 self[SCG_CONTEXT_SWITCHES], total[SCG_CONTEXT_SWITCHES]);
+
+    /* And our time waiting for locks.  */
+    if (scg_locks)
+        fprintf (out_file, "\t\tlock wait %lu/%lu ns, cond wait %lu/%lu ns\n",
+                 self[SCG_LOCK_WAIT], total[SCG_LOCK_WAIT],
+                 self[SCG_COND_WAIT], total[SCG_COND_WAIT]);
+
     /* Output the callees, most common to least common. */
     sorted.clear();
     scg_map_switcheroo (sorted, callee_counts);
@@ -232,11 +448,18 @@ void scg_function_record::output (FILE *        out_file,
 
 void scg_output_profile()
 {
+    // Don't sample our own allocations: they would add to the hash table as we
+    // walk it.
+    scg_heap_pause();
+
     scg_database database;
 
+    // The symbol table is kept between reports; this only catches up with
+    // objects loaded or unloaded since the last one.
     reflect_symtab_create();
+    database.symbolize (scg_node_hash, SCG_NODE_HASH_SIZE);
     database.build_from (scg_node_hash, SCG_NODE_HASH_SIZE);
-    reflect_symtab_destroy();
+    database.build_locks (scg_lock_sites, SCG_LOCK_SITES);
 
     FILE * out_file = NULL;
     bool   close_it = true;
@@ -267,4 +490,6 @@ void scg_output_profile()
     if (close_it) {
         fclose (out_file);
     }
+
+    scg_heap_resume();
 }
@@ -10,6 +10,8 @@ typedef int (* pth_creat) (pthread_t *, const pthread_attr_t *,
                            thread_func, void *);
 
 static pth_creat pthread_create_real;
+static pth_creat pthread_create_2_2_5;
+static pth_creat pthread_create_2_34;
 
 typedef struct {
    thread_func  function;
@@ -28,26 +30,25 @@ static void * my_thread_func (void * p)
    return function (arg);
 }
 
-__asm__ ("\n.symver my_pthread_create, pthread_create@@GLIBC_2.1\n");
-
-int my_pthread_create (pthread_t * __restrict            thread,
-                       const pthread_attr_t * __restrict attr,
-                       thread_func                       function,
-                       void *                            arg)
+/* Create a thread through the real pthread_create of the given version.  */
+static int wrap_pthread_create (pth_creat *                      real,
+                                const char *                     version,
+                                pthread_t * __restrict            thread,
+                                const pthread_attr_t * __restrict attr,
+                                thread_func                       function,
+                                void *                            arg)
 {
    context_t * context = (context_t *) malloc (sizeof (context_t));
    int ret;
 
-   if (pthread_create_real == NULL) {
-      pthread_create_real = (pth_creat) dlvsym (RTLD_NEXT,
-                                                "pthread_create",
-                                                "GLIBC_2.1");
+   if (*real == NULL) {
+      *real = (pth_creat) dlvsym (RTLD_NEXT, "pthread_create", version);
    }
 
    context->function = function;
    context->arg = arg;
 
-   ret = pthread_create_real (thread, attr, my_thread_func, context);
+   ret = (*real) (thread, attr, my_thread_func, context);
 
    if (ret != 0) {
       free (context);
@@ -55,3 +56,37 @@ int my_pthread_create (pthread_t * __restrict            thread,
 
    return ret;
 }
+
+/* Programs bind to pthread_create at the version their glibc defaults to: 2.1
+ * on ia32, 2.2.5 on x86-64, and 2.34 once libpthread was merged into libc.
+ * We take all three; see version.ld.  */
+__asm__ ("\n.symver my_pthread_create, pthread_create@GLIBC_2.1\n");
+__asm__ ("\n.symver my_pthread_create_2_2_5, pthread_create@GLIBC_2.2.5\n");
+__asm__ ("\n.symver my_pthread_create_2_34, pthread_create@@GLIBC_2.34\n");
+
+int my_pthread_create (pthread_t * __restrict            thread,
+                       const pthread_attr_t * __restrict attr,
+                       thread_func                       function,
+                       void *                            arg)
+{
+   return wrap_pthread_create (&pthread_create_real, "GLIBC_2.1",
+                               thread, attr, function, arg);
+}
+
+int my_pthread_create_2_2_5 (pthread_t * __restrict            thread,
+                             const pthread_attr_t * __restrict attr,
+                             thread_func                       function,
+                             void *                            arg)
+{
+   return wrap_pthread_create (&pthread_create_2_2_5, "GLIBC_2.2.5",
+                               thread, attr, function, arg);
+}
+
+int my_pthread_create_2_34 (pthread_t * __restrict            thread,
+                            const pthread_attr_t * __restrict attr,
+                            thread_func                       function,
+                            void *                            arg)
+{
+   return wrap_pthread_create (&pthread_create_2_34, "GLIBC_2.34",
+                               thread, attr, function, arg);
+}